@@ -14,10 +14,14 @@
 #include <ctype.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <inttypes.h>
 #include <assert.h>
 
 #include "libdevmem.h" /* self */
+#ifdef LIBDEVMEM_SIM_HOOKS
+#include "libdevmem_sim.h"
+#endif
 
 #ifndef C_ASSERT
 //#define C_ASSERT(cond) typedef char foo##__LINE__[1 - (!cond)] foo_t##__LINE__
@@ -62,6 +66,18 @@ static int g_env_read = 0;
 static struct dmem_mapping_s *g_map = NULL; //TODO revise use of g_map & single mapping
 
 static int get_env_params(void);
+static int kill_switch(void);
+static int env_sim(void);
+
+// In libdevmem_sim.c, if linked
+extern void dmem_sim_clear(struct dmem_mapping_s *dp) __attribute__((weak));
+
+// Tells libdevmem_sim.c whether the accessors call its hooks
+#if defined(LIBDEVMEM_SIM_HOOKS) && !defined(LIBDEVMEM_NO_EXTRAS)
+const int dmem__sim_hooks_built = 1;
+#else
+const int dmem__sim_hooks_built = 0;
+#endif
 
 struct mapping_priv_s {
     int fd;             // 0 when not initialized, -1 = invalid
@@ -72,10 +88,13 @@ struct mapping_priv_s {
     size_t mmap_size;   // adjusted mapping size
     size_t mmap_offset; // offset from mmap_va to map_ptr
     int offs_mode;
+    void *sim_va;       // MF_SIMULATED: library view of the backing memory
 };
 
 C_ASSERT(sizeof(struct mapping_priv_s) <= sizeof(struct dmem_mapping_s.reserved));
 
+static int map_simulated(struct dmem_mapping_s *param, struct mapping_priv_s *mp);
+
 
 int dmem_mapping_map(struct dmem_mapping_s *param)
 {
@@ -89,10 +108,26 @@ int dmem_mapping_map(struct dmem_mapping_s *param)
 
     g_map = param;
     struct mapping_priv_s *mp = (struct mapping_priv_s*)&param->reserved[0];
+    mp->sim_va = NULL;
 
     if (!pagesize)
         pagesize = (unsigned)getpagesize(); /* or sysconf(_SC_PAGESIZE)  */
 
+    // Run without the device: DEVMEMOPT="+sim" simulates all mappings
+    if (!(param->flags & MF_SIMULATED) && env_sim())
+        param->flags |= MF_SIMULATED;
+    if (param->flags & MF_SIMULATED) {
+        int ret;
+        if (env_sim() && !g_env_read)
+            ret = dmem_init(); // +d, -NDM; no address window needed
+        else
+            ret = kill_switch() ? -1 : 0;
+        if (!ret)
+            ret = map_simulated(param, mp);
+        if (ret) g_map = NULL;
+        return ret;
+    }
+
     dmem_mapping_size_t size = param->map_size;
     if (size < pagesize)
         size = pagesize;
@@ -195,6 +230,13 @@ int dmem_mapping_unmap(struct dmem_mapping_s *param)
 
     struct mapping_priv_s *mp = (struct mapping_priv_s *)&param->reserved[0];
 
+    if (mp->sim_va) {
+        if (dmem_sim_clear)
+            dmem_sim_clear(param);
+        munmap(mp->sim_va, mp->mmap_size);
+        mp->sim_va = NULL;
+    }
+
     if (munmap(mp->mmap_va, mp->mmap_size) != 0) {
         printerr("ERROR munmap (%d) %s\n", errno, strerror(errno));
     }
@@ -208,6 +250,69 @@ int dmem_mapping_unmap(struct dmem_mapping_s *param)
     return 0;
 }
 
+// Simulated device: memfd mapped twice, user view and library view.
+// No /dev/mem, no environment window; map_addr is taken as is.
+static int map_simulated(struct dmem_mapping_s *param, struct mapping_priv_s *mp)
+{
+    dmem_mapping_size_t size = param->map_size;
+    if (size < pagesize)
+        size = pagesize;
+
+    mp->offs_mode = !(param->flags & MF_ABSOLUTE);
+    mp->mmap_base = param->map_addr & ~((dmem_phys_address_t)pagesize-1);
+    mp->mmap_offset = param->map_addr - mp->mmap_base;
+    mp->mmap_size = ((mp->mmap_offset + size - 1) / pagesize) * pagesize + pagesize;
+    mp->mmap_end = mp->mmap_base + mp->mmap_size - 1;
+
+    mp->fd = (int)syscall(SYS_memfd_create, "libdevmem-sim", 0);
+    if (mp->fd == -1) {
+        printerr("Error creating memfd (%d) : %s\n", errno, strerror(errno));
+        return errno;
+    }
+    if (ftruncate(mp->fd, (off_t)mp->mmap_size) != 0) {
+        int err = errno;
+        printerr("Error sizing memfd (%d) : %s\n", err, strerror(err));
+        close(mp->fd);
+        return err;
+    }
+
+    int prot = PROT_READ | PROT_WRITE;
+    if (param->flags & MF_READONLY) prot = PROT_READ;
+    mp->mmap_va = mmap(0, mp->mmap_size, prot, MAP_SHARED, mp->fd, 0);
+    if (mp->mmap_va == MAP_FAILED) {
+        int err = errno;
+        printerr("Error mapping (%d) : %s\n", err, strerror(err));
+        close(mp->fd);
+        return err;
+    }
+    mp->sim_va = mmap(0, mp->mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, mp->fd, 0);
+    if (mp->sim_va == MAP_FAILED) {
+        int err = errno;
+        printerr("Error mapping (%d) : %s\n", err, strerror(err));
+        munmap(mp->mmap_va, mp->mmap_size);
+        close(mp->fd);
+        mp->sim_va = NULL;
+        return err;
+    }
+
+    *((char**)&param->map_ptr) = mp->mmap_va + mp->mmap_offset;
+    mp->mmap_va_end = mp->mmap_va + mp->mmap_size - 1;
+
+    if (f_dbg) {
+        printerr("Simulated device memory at virt. addr [%p - %p[\n", mp->mmap_va, mp->mmap_va_end);
+    }
+    return 0;
+}
+
+// Library view of a simulated mapping, same layout as map_ptr
+void *dmem__sim_alias(struct dmem_mapping_s *dp)
+{
+    struct mapping_priv_s *mp = (struct mapping_priv_s *)&dp->reserved[0];
+    if (!dp->map_ptr || !mp->sim_va)
+        return NULL;
+    return (char*)mp->sim_va + mp->mmap_offset;
+}
+
 //int dmem_init(void)
 int dmem__init_(int addrsize, int mapsize, void *reserved)
 {
@@ -232,6 +337,15 @@ void *dmem_get_pointer( struct dmem_mapping_s *dp, dmem_mapping_size_t off,
 }
 
 
+dmem_phys_address_t dmem_get_phys_addr(struct dmem_mapping_s *dp)
+{
+    struct mapping_priv_s *mp = (struct mapping_priv_s *)&dp->reserved[0];
+    if (!dp->map_ptr || !mp->mmap_va)
+        return (dmem_phys_address_t)(-1L);
+    return mp->mmap_base + mp->mmap_offset;
+}
+
+
 int dmem_set_debug(int flags, FILE *dbgfile)
 {
     f_dbg = !!(flags & 0x1);
@@ -261,6 +375,25 @@ int dmem_print_version(void)
     return 0;
 }
 
+// Is use of the module forbidden by -NDM in the environment?
+static int kill_switch(void)
+{
+    char *p = getenv(ENV_PARAMS);
+    if (p && strstr(p, "-NDM")) {
+        fprintf(stderr,
+            "ERROR: Env. parameter in %s forbids use of this memory access module\n", ENV_PARAMS);
+        return 1;
+    }
+    return 0;
+}
+
+// Is the device simulated by DEVMEMOPT="+sim"?
+static int env_sim(void)
+{
+    char *p = getenv(ENV_PARAMS);
+    return p && strstr(p, "+sim");
+}
+
 // Get environment parameters
 // -> phys base address, size
 static int get_env_params(void)
@@ -282,11 +415,8 @@ static int get_env_params(void)
             fPrint++;
         }
 
-        if (strstr(p, "-NDM")) { // kill switch
-            fprintf(stderr,
-                "ERROR: Env. parameter in %s forbids use of this memory access module\n", ENV_PARAMS);
+        if (kill_switch())
             return -1;
-        }
     }
     //else if (fPrint)
     //    printf("%s not set\n", ENV_PARAMS);
@@ -298,6 +428,13 @@ static int get_env_params(void)
     if (fPrint && p)
         printf("%s = \"%s\"\n", ENV_PARAMS, p);
 
+    if (env_sim()) { // all mappings simulated, the address window is not used
+        if (fPrint)
+            printf("Simulated device, %s and %s ignored\n", ENV_MBASE, ENV_MEM_END);
+        g_env_read = 1;
+        return 0;
+    }
+
     p = getenv(ENV_MBASE);
     if (p) {
         errno = 0;
@@ -372,35 +509,52 @@ static void dmem_error(void)
 }
 
 
+// Simulated device registers: call the model instead of accessing memory
+#ifdef LIBDEVMEM_SIM_HOOKS
+#define SIM_HOOK_READ(mp, T) \
+    do { uint32_t v_; if (dmem__sim_nranges && dmem__sim_read(mp, sizeof(T), &v_)) return (T)v_; } while (0)
+#define SIM_HOOK_WRITE(mp, v) \
+    do { if (dmem__sim_nranges && dmem__sim_write(mp, sizeof(v), v)) return; } while (0)
+#else
+#define SIM_HOOK_READ(mp, T)  /**/
+#define SIM_HOOK_WRITE(mp, v) /**/
+#endif // LIBDEVMEM_SIM_HOOKS
+
 // Fast I/O ops via pointer
 // Pointers can be obtained from dmem_get_pointer()
 void dmem_write32p(void *mp, uint32_t v)
 {
+    SIM_HOOK_WRITE(mp, v);
     *(volatile uint32_t*)mp = v;
 }
 
 void dmem_write16p(void *mp, uint16_t v)
 {
+    SIM_HOOK_WRITE(mp, v);
     *(volatile uint16_t*)mp = v;
 }
 
 void dmem_write8p(void *mp, uint8_t v)
 {
+    SIM_HOOK_WRITE(mp, v);
     *(volatile uint8_t*)mp = v;
 }
 
 uint32_t dmem_read32p(void *mp)
 {
+    SIM_HOOK_READ(mp, uint32_t);
     return *(volatile uint32_t*)mp;
 }
 
 uint16_t dmem_read16p(void *mp)
 {
+    SIM_HOOK_READ(mp, uint16_t);
     return *(volatile uint16_t*)mp;
 }
 
 uint8_t dmem_read8p(void *mp)
 {
+    SIM_HOOK_READ(mp, uint8_t);
     return *(volatile uint8_t*)mp;
 }
 
@@ -26,6 +26,7 @@ struct dmem_mapping_s {
 enum dmem_mapping_flags {
     MF_ABSOLUTE = 0x01, // Absolute physical address, not offset
     MF_READONLY = 0x02,
+    MF_SIMULATED = 0x04, // RAM backed stand-in for the device, see libdevmem_sim.h
 };
 
 typedef struct dmem_mapping_s *dmem_mapping_hnd_t;
@@ -54,6 +55,11 @@ int dmem_mapping_map(struct dmem_mapping_s *params);
 //          or the virtual address in dp is NULL (not mapped yet?)
 void *dmem_get_pointer(dmem_mapping_hnd_t dp, dmem_mapping_size_t off, uint32_t size);
 
+// Get physical address of the mapping
+// @param[in] dp     - dmem_mapping_s, after successfull dmem_mapping_map()
+// @return physical address of map_ptr, or (dmem_phys_address_t)-1 if not mapped
+dmem_phys_address_t dmem_get_phys_addr(dmem_mapping_hnd_t dp);
+
 // Unmap:
 // @param[in] dp - struct dmem_mapping_s, after successfull dmem_mapping_map()
 // @return error code
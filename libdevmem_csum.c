@@ -0,0 +1,438 @@
+/**
+* libdevmem extras: checksums over device memory
+*
+* CRC32C uses the SSE4.2 crc32 instruction on x86 or the ARMv8 CRC
+* extension on aarch64, both detected at run time, else a table driven
+* implementation.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CSUM_HAVE_SSE42 1
+#endif
+#if defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#define CSUM_HAVE_ARMCRC 1
+#endif
+
+#include "libdevmem_csum.h" /* self */
+
+#define CSUM_CHUNK  (16 * 1024) // bytes, fits in L1 data cache
+
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+
+//============================================================================
+// CRC32C
+//============================================================================
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len--)
+        crc = crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#if CSUM_HAVE_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    for ( ; len && ((uintptr_t)p & 7); len--)
+        crc = _mm_crc32_u8(crc, *p++);
+#if defined(__x86_64__)
+    for ( ; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = (uint32_t)_mm_crc32_u64(crc, v);
+    }
+#endif
+    for ( ; len >= 4; len -= 4, p += 4) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = _mm_crc32_u32(crc, v);
+    }
+    for ( ; len; len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#elif CSUM_HAVE_ARMCRC
+__attribute__((target("+crc")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    for ( ; len && ((uintptr_t)p & 7); len--)
+        crc = __crc32cb(crc, *p++);
+    for ( ; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = __crc32cd(crc, v);
+    }
+    for ( ; len; len--)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+#endif
+
+static uint32_t (*crc32c_fn)(uint32_t, const uint8_t *, size_t);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+// Build the table and select the implementation, once
+static void crc32c_init(void)
+{
+    uint32_t i, k, c;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (k = 0; k < 8; k++)
+            c = (c >> 1) ^ (0x82F63B78u & (0 - (c & 1)));
+        crc32c_table[i] = c;
+    }
+    crc32c_fn = crc32c_sw;
+#if CSUM_HAVE_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_fn = crc32c_hw;
+#elif CSUM_HAVE_ARMCRC
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+        crc32c_fn = crc32c_hw;
+#endif
+}
+
+static uint32_t crc32c(uint32_t crc, const void *p, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_fn(~crc, (const uint8_t *)p, len);
+}
+
+//============================================================================
+// xxHash64
+//============================================================================
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_rd64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v; // little endian hosts only
+}
+
+static inline uint32_t xxh_rd32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t in)
+{
+    acc += in * XXH_P2;
+    acc = xxh_rotl(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t v)
+{
+    acc ^= xxh_round(0, v);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static void xxh64_update(struct dmem_csum_s *cs, const uint8_t *p, size_t len)
+{
+    const uint8_t *end = p + len;
+
+    cs->total_len += len;
+    if (cs->memsize + len < 32) {
+        memcpy(cs->mem + cs->memsize, p, len);
+        cs->memsize += (unsigned)len;
+        return;
+    }
+    if (cs->memsize) {
+        memcpy(cs->mem + cs->memsize, p, 32 - cs->memsize);
+        p += 32 - cs->memsize;
+        cs->v[0] = xxh_round(cs->v[0], xxh_rd64(cs->mem));
+        cs->v[1] = xxh_round(cs->v[1], xxh_rd64(cs->mem + 8));
+        cs->v[2] = xxh_round(cs->v[2], xxh_rd64(cs->mem + 16));
+        cs->v[3] = xxh_round(cs->v[3], xxh_rd64(cs->mem + 24));
+        cs->memsize = 0;
+    }
+    for ( ; p + 32 <= end; p += 32) {
+        cs->v[0] = xxh_round(cs->v[0], xxh_rd64(p));
+        cs->v[1] = xxh_round(cs->v[1], xxh_rd64(p + 8));
+        cs->v[2] = xxh_round(cs->v[2], xxh_rd64(p + 16));
+        cs->v[3] = xxh_round(cs->v[3], xxh_rd64(p + 24));
+    }
+    if (p < end) {
+        memcpy(cs->mem, p, end - p);
+        cs->memsize = (unsigned)(end - p);
+    }
+}
+
+static uint64_t xxh64_final(const struct dmem_csum_s *cs)
+{
+    const uint8_t *p = cs->mem, *end = cs->mem + cs->memsize;
+    uint64_t h;
+
+    if (cs->total_len >= 32) {
+        h = xxh_rotl(cs->v[0], 1) + xxh_rotl(cs->v[1], 7) +
+            xxh_rotl(cs->v[2], 12) + xxh_rotl(cs->v[3], 18);
+        h = xxh_merge(h, cs->v[0]);
+        h = xxh_merge(h, cs->v[1]);
+        h = xxh_merge(h, cs->v[2]);
+        h = xxh_merge(h, cs->v[3]);
+    } else {
+        h = cs->seed + XXH_P5;
+    }
+    h += cs->total_len;
+
+    for ( ; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, xxh_rd64(p));
+        h = xxh_rotl(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)xxh_rd32(p) * XXH_P1;
+        h = xxh_rotl(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for ( ; p < end; p++) {
+        h ^= (*p) * XXH_P5;
+        h = xxh_rotl(h, 11) * XXH_P1;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+//============================================================================
+// Streaming API
+//============================================================================
+
+void dmem_csum_init(struct dmem_csum_s *cs, unsigned algo, uint64_t seed)
+{
+    memset(cs, 0, sizeof(*cs));
+    cs->algo = algo;
+    cs->seed = seed;
+    cs->crc = (uint32_t)seed;
+    cs->v[0] = seed + XXH_P1 + XXH_P2;
+    cs->v[1] = seed + XXH_P2;
+    cs->v[2] = seed;
+    cs->v[3] = seed - XXH_P1;
+}
+
+void dmem_csum_update(struct dmem_csum_s *cs, const void *buf, size_t len)
+{
+    if (cs->algo == CSUM_XXH64)
+        xxh64_update(cs, (const uint8_t *)buf, len);
+    else
+        cs->crc = crc32c(cs->crc, buf, len);
+}
+
+uint64_t dmem_csum_final(const struct dmem_csum_s *cs)
+{
+    if (cs->algo == CSUM_XXH64)
+        return xxh64_final(cs);
+    return cs->crc;
+}
+
+//============================================================================
+// Device memory
+//============================================================================
+
+// Copy from the mapping to a host buffer with 128-bit loads where aligned
+static void csum_copy_from_dev(uint8_t *dst, const volatile uint8_t *src, size_t len)
+{
+    for ( ; len && ((uintptr_t)src & 3); len--)
+        *dst++ = *src++;
+    for ( ; len >= 4 && ((uintptr_t)src & (sizeof(v4u32) - 1)); len -= 4, src += 4, dst += 4) {
+        uint32_t v = *(const volatile uint32_t *)src;
+        memcpy(dst, &v, sizeof(v));
+    }
+    for ( ; len >= sizeof(v4u32); len -= sizeof(v4u32), src += sizeof(v4u32), dst += sizeof(v4u32)) {
+        v4u32 v = *(const volatile v4u32 *)src;
+        memcpy(dst, &v, sizeof(v));
+    }
+    for ( ; len >= 4; len -= 4, src += 4, dst += 4) {
+        uint32_t v = *(const volatile uint32_t *)src;
+        memcpy(dst, &v, sizeof(v));
+    }
+    for ( ; len; len--)
+        *dst++ = *src++;
+}
+
+static int csum_region_ptr(dmem_mapping_hnd_t dp, dmem_mapping_size_t off, dmem_mapping_size_t *size,
+                           const volatile uint8_t **pp)
+{
+    if (!dp)
+        return -1;
+    if (off >= dp->map_size)
+        return ERANGE;
+    if (*size == 0)
+        *size = dp->map_size - off;
+    *pp = (const volatile uint8_t *)dmem_get_pointer(dp, off, *size);
+    if (!*pp)
+        return ERANGE;
+    return 0;
+}
+
+int dmem_csum_region(dmem_mapping_hnd_t dp, dmem_mapping_size_t off, dmem_mapping_size_t size,
+                     unsigned algo, uint64_t *digest)
+{
+    uint8_t chunk[CSUM_CHUNK] __attribute__((aligned(64)));
+    const volatile uint8_t *p;
+    struct dmem_csum_s cs;
+    size_t n;
+    int err;
+
+    if (algo != CSUM_CRC32C && algo != CSUM_XXH64)
+        return EINVAL;
+    err = csum_region_ptr(dp, off, &size, &p);
+    if (err)
+        return err;
+
+    dmem_csum_init(&cs, algo, 0);
+    for ( ; size; size -= n, p += n) {
+        n = size < sizeof(chunk) ? size : sizeof(chunk);
+        csum_copy_from_dev(chunk, p, n);
+        dmem_csum_update(&cs, chunk, n);
+    }
+    if (digest)
+        *digest = dmem_csum_final(&cs);
+    return 0;
+}
+
+int dmem_csum_verify(dmem_mapping_hnd_t dp, dmem_mapping_size_t off, dmem_mapping_size_t size,
+                     unsigned algo, uint64_t expected)
+{
+    uint64_t digest;
+    int err = dmem_csum_region(dp, off, size, algo, &digest);
+    if (err)
+        return err;
+    return digest == expected ? 0 : EBADMSG;
+}
+
+int dmem_csum_verify_file(dmem_mapping_hnd_t dp, dmem_mapping_size_t off, const char *path,
+                          dmem_mapping_size_t *bad_off)
+{
+    uint8_t dchunk[CSUM_CHUNK] __attribute__((aligned(64)));
+    uint8_t fchunk[CSUM_CHUNK] __attribute__((aligned(64)));
+    const volatile uint8_t *p;
+    dmem_mapping_size_t size, done;
+    struct stat st;
+    int fd, err = 0;
+
+    if (!dp || !path)
+        return -1;
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return errno;
+    if (fstat(fd, &st) != 0) {
+        err = errno;
+        goto out;
+    }
+    if (st.st_size == 0 || (uint64_t)st.st_size > dp->map_size) {
+        err = ERANGE;
+        goto out;
+    }
+    size = (dmem_mapping_size_t)st.st_size;
+    err = csum_region_ptr(dp, off, &size, &p);
+    if (err)
+        goto out;
+
+    for (done = 0; done < size; ) {
+        size_t n = size - done < sizeof(fchunk) ? size - done : sizeof(fchunk);
+        ssize_t rd = read(fd, fchunk, n);
+        if (rd <= 0) {
+            err = rd < 0 ? errno : EIO;
+            goto out;
+        }
+        n = (size_t)rd;
+        csum_copy_from_dev(dchunk, p + done, n);
+        if (memcmp(dchunk, fchunk, n) != 0) {
+            size_t i = 0;
+            while (dchunk[i] == fchunk[i])
+                i++;
+            if (bad_off)
+                *bad_off = off + done + (dmem_mapping_size_t)i;
+            err = EBADMSG;
+            goto out;
+        }
+        done += (dmem_mapping_size_t)n;
+    }
+
+out:
+    close(fd);
+    return err;
+}
+
+#ifndef LIBDEVMEM_NO_EXTRAS
+int dmem_read_buf32_csum(dmem_mapping_hnd_t dp, uint32_t *buf, dmem_mapping_size_t off, unsigned cnt,
+                         struct dmem_csum_s *cs)
+{
+    const unsigned step = CSUM_CHUNK / sizeof(uint32_t);
+    uint8_t *p;
+    unsigned n;
+
+    if (!dp || !cs)
+        return -1;
+    if (cnt > UINT32_MAX / sizeof(uint32_t))
+        return ERANGE;
+    p = dmem_get_pointer(dp, off, cnt * sizeof(uint32_t));
+    if (!p)
+        return ERANGE;
+
+    for ( ; cnt; cnt -= n, buf += n, p += n * sizeof(uint32_t)) {
+        n = cnt < step ? cnt : step;
+        dmem_read_buf32p(p, buf, n);
+        dmem_csum_update(cs, buf, n * sizeof(uint32_t));
+    }
+    return 0;
+}
+
+int dmem_write_buf32_csum(dmem_mapping_hnd_t dp, const uint32_t *buf, dmem_mapping_size_t off, unsigned cnt,
+                          struct dmem_csum_s *cs)
+{
+    const unsigned step = CSUM_CHUNK / sizeof(uint32_t);
+    uint8_t *p;
+    unsigned n;
+
+    if (!dp || !cs)
+        return -1;
+    if (cnt > UINT32_MAX / sizeof(uint32_t))
+        return ERANGE;
+    p = dmem_get_pointer(dp, off, cnt * sizeof(uint32_t));
+    if (!p)
+        return ERANGE;
+
+    for ( ; cnt; cnt -= n, buf += n, p += n * sizeof(uint32_t)) {
+        n = cnt < step ? cnt : step;
+        dmem_csum_update(cs, buf, n * sizeof(uint32_t));
+        dmem_write_buf32p(p, buf, n);
+    }
+    return 0;
+}
+#endif //LIBDEVMEM_NO_EXTRAS
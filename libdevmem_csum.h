@@ -0,0 +1,76 @@
+/**
+* libdevmem extras: checksums over device memory
+*
+* Data is read from the mapping in cache-sized chunks and hashed
+* while hot in cache, so there is one pass over the device memory
+* and no large temporary buffer.
+*/
+
+#ifndef libdevmem_csum_h_
+#define libdevmem_csum_h_
+
+#include <stddef.h>
+#include "libdevmem.h"
+
+enum dmem_csum_algo {
+    CSUM_CRC32C = 1, // Castagnoli CRC, SSE4.2 / ARMv8 CRC instructions when available
+    CSUM_XXH64  = 2, // xxHash64
+};
+
+// Streaming checksum state. Treat as opaque.
+struct dmem_csum_s {
+    unsigned algo;
+    uint32_t crc;
+    uint64_t seed;
+    uint64_t total_len;
+    uint64_t v[4];
+    uint8_t  mem[32];
+    unsigned memsize;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Streaming checksum of host memory:
+// @param[in] algo - dmem_csum_algo
+// @param[in] seed - initial CRC value (normally 0) or xxHash seed
+void     dmem_csum_init(struct dmem_csum_s *cs, unsigned algo, uint64_t seed);
+void     dmem_csum_update(struct dmem_csum_s *cs, const void *buf, size_t len);
+uint64_t dmem_csum_final(const struct dmem_csum_s *cs);
+
+// Checksum of a region of the mapping
+// @param[in]  dp     - mapping, after successfull dmem_mapping_map()
+// @param[in]  off, size - region; size 0 = up to end of mapping
+// @param[in]  algo   - dmem_csum_algo, seed 0
+// @param[out] digest - result, CRC32C is in the low 32 bits
+// @return error code
+int dmem_csum_region(dmem_mapping_hnd_t dp, dmem_mapping_size_t off, dmem_mapping_size_t size,
+                     unsigned algo, uint64_t *digest);
+
+// Verify a region against expected digest
+// @return 0 if matches, EBADMSG if not, or error code
+int dmem_csum_verify(dmem_mapping_hnd_t dp, dmem_mapping_size_t off, dmem_mapping_size_t size,
+                     unsigned algo, uint64_t expected);
+
+// Verify a region against content of a file. The region size is the file size.
+// @param[out] bad_off - offset of the first difference from the mapping base, can be NULL
+// @return 0 if matches, EBADMSG if not, or error code
+int dmem_csum_verify_file(dmem_mapping_hnd_t dp, dmem_mapping_size_t off, const char *path,
+                          dmem_mapping_size_t *bad_off);
+
+#ifndef LIBDEVMEM_NO_EXTRAS
+// Like dmem_read_buf32/dmem_write_buf32, also update the checksum of the
+// data transferred, chunk by chunk while it is in cache.
+// @return error code (ERANGE if the range is not in the mapping)
+int dmem_read_buf32_csum(dmem_mapping_hnd_t dp, uint32_t *buf, dmem_mapping_size_t off, unsigned cnt,
+                         struct dmem_csum_s *cs);
+int dmem_write_buf32_csum(dmem_mapping_hnd_t dp, const uint32_t *buf, dmem_mapping_size_t off, unsigned cnt,
+                          struct dmem_csum_s *cs);
+#endif //LIBDEVMEM_NO_EXTRAS
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* libdevmem_csum_h_ */
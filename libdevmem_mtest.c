@@ -0,0 +1,512 @@
+/**
+* libdevmem extras: memory test and scrub engine
+*
+* Patterns are generated from the word index, so any part of the region
+* can be filled or verified independently: the region is split in slices,
+* one per thread. Kernels do 128-bit volatile loads/stores via GCC vector
+* extensions (SSE2 on x86, NEON on ARM), with 32-bit accesses for the
+* unaligned head and tail of each slice.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libdevmem_mtest.h" /* self */
+
+#ifndef MT_INLINE
+#define MT_INLINE __inline__ __attribute__((always_inline))
+#endif // !MT_INLINE
+
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+
+#define MT_VEC_WORDS   4
+#define MT_SLICE_ALIGN 16           // words, slice boundaries at 64 bytes
+#define MT_MIN_SLICE   (16 * 1024)  // words, don't start a thread for less
+#define SCRUB_CHUNK    (16 * 1024)  // words per rate limiter step, max.
+
+static const v4u32 v_iota = { 0, 1, 2, 3 };
+
+// Pattern value for word indexes idx (index from the mapping base)
+static MT_INLINE v4u32 mt_gen(unsigned pattern, uint32_t pass, uint32_t seed, v4u32 idx)
+{
+    const v4u32 one = { 1, 1, 1, 1 };
+    v4u32 x;
+
+    switch (pattern) {
+    case MT_WALKING_ONES:
+        return one << ((idx + pass) & 31);
+    case MT_WALKING_ZEROS:
+        return ~(one << ((idx + pass) & 31));
+    case MT_ADDRESS:
+        return (idx << 2) ^ (0 - pass);
+    case MT_CHECKERBOARD:
+        return 0x55555555 ^ (0 - ((idx ^ pass) & 1));
+    default: // MT_RANDOM, integer hash of the index, then inverted
+        x = idx * 0x9E3779B9u + seed;
+        x ^= x >> 16;
+        x *= 0x7FEB352Du;
+        x ^= x >> 15;
+        x *= 0x846CA68Bu;
+        x ^= x >> 16;
+        return x ^ (0 - pass);
+    }
+}
+
+static MT_INLINE uint32_t mt_gen1(unsigned pattern, uint32_t pass, uint32_t seed, uint32_t idx)
+{
+    v4u32 v = { idx, idx, idx, idx };
+    return mt_gen(pattern, pass, seed, v)[0];
+}
+
+// Number of passes of a pattern
+static unsigned mt_passes(unsigned pattern)
+{
+    return (pattern & (MT_WALKING_ONES | MT_WALKING_ZEROS)) ? 32 : 2;
+}
+
+// Call fn(PATTERN, args...) with the pattern as compile time constant
+#define MT_DISPATCH(pat, fn, ...) \
+    switch (pat) { \
+    case MT_WALKING_ONES:  fn(MT_WALKING_ONES,  __VA_ARGS__); break; \
+    case MT_WALKING_ZEROS: fn(MT_WALKING_ZEROS, __VA_ARGS__); break; \
+    case MT_ADDRESS:       fn(MT_ADDRESS,       __VA_ARGS__); break; \
+    case MT_CHECKERBOARD:  fn(MT_CHECKERBOARD,  __VA_ARGS__); break; \
+    default:               fn(MT_RANDOM,        __VA_ARGS__); break; \
+    }
+
+// One slice of the region for one thread
+struct mt_slice_s {
+    pthread_t tid;
+    volatile uint32_t *p;   // slice start
+    size_t n;               // words
+    uint32_t gidx;          // word index of p from the mapping base
+    unsigned pattern;
+    uint32_t pass;
+    uint32_t seed;
+    int verify;             // 0 = fill, 1 = verify
+    const struct dmem_numa_info_s *numa; // pin to these CPUs if not NULL
+    struct dmem_mtest_error_s *errs; // first mismatches of this slice
+    unsigned max_errs;
+    unsigned n_errs;
+    uint64_t n_bad;
+};
+
+static void mt_record(struct mt_slice_s *s, uint32_t idx, uint32_t exp, uint32_t act)
+{
+    s->n_bad++;
+    if (s->n_errs < s->max_errs) {
+        struct dmem_mtest_error_s *e = &s->errs[s->n_errs++];
+        e->offset = (dmem_mapping_size_t)idx * sizeof(uint32_t);
+        e->expected = exp;
+        e->actual = act;
+        e->pattern = s->pattern;
+    }
+}
+
+static MT_INLINE void mt_fill_k(unsigned pattern, struct mt_slice_s *s)
+{
+    volatile uint32_t *p = s->p;
+    size_t i = 0, n = s->n;
+
+    for ( ; i < n && ((uintptr_t)(p + i) & (sizeof(v4u32) - 1)); i++)
+        p[i] = mt_gen1(pattern, s->pass, s->seed, s->gidx + i);
+    for ( ; i + MT_VEC_WORDS <= n; i += MT_VEC_WORDS)
+        *(volatile v4u32 *)(p + i) = mt_gen(pattern, s->pass, s->seed, v_iota + (uint32_t)(s->gidx + i));
+    for ( ; i < n; i++)
+        p[i] = mt_gen1(pattern, s->pass, s->seed, s->gidx + i);
+}
+
+static MT_INLINE void mt_verify_k(unsigned pattern, struct mt_slice_s *s)
+{
+    volatile uint32_t *p = s->p;
+    size_t i = 0, n = s->n;
+    uint32_t e, a;
+    int k;
+
+    for ( ; i < n && ((uintptr_t)(p + i) & (sizeof(v4u32) - 1)); i++) {
+        e = mt_gen1(pattern, s->pass, s->seed, s->gidx + i);
+        if ((a = p[i]) != e)
+            mt_record(s, s->gidx + i, e, a);
+    }
+    for ( ; i + MT_VEC_WORDS <= n; i += MT_VEC_WORDS) {
+        v4u32 ve = mt_gen(pattern, s->pass, s->seed, v_iota + (uint32_t)(s->gidx + i));
+        v4u32 va = *(volatile v4u32 *)(p + i);
+        v4u32 d = va ^ ve;
+        if ((d[0] | d[1] | d[2] | d[3]) == 0)
+            continue;
+        for (k = 0; k < MT_VEC_WORDS; k++) {
+            if (d[k])
+                mt_record(s, s->gidx + i + k, ve[k], va[k]);
+        }
+    }
+    for ( ; i < n; i++) {
+        e = mt_gen1(pattern, s->pass, s->seed, s->gidx + i);
+        if ((a = p[i]) != e)
+            mt_record(s, s->gidx + i, e, a);
+    }
+}
+
+static void *mt_thread(void *arg)
+{
+    struct mt_slice_s *s = (struct mt_slice_s *)arg;
+    if (s->verify) {
+        MT_DISPATCH(s->pattern, mt_verify_k, s);
+    } else {
+        MT_DISPATCH(s->pattern, mt_fill_k, s);
+    }
+    return NULL;
+}
+
+// Run one phase on all slices; slice 0 runs in the calling thread,
+// unless workers are pinned (the caller's affinity is left as is).
+static int mt_run_phase(struct mt_slice_s *sl, unsigned nsl)
+{
+    unsigned i, first = sl[0].numa ? 0 : 1, started = first;
+    pthread_attr_t attr;
+    int err;
+
+    err = pthread_attr_init(&attr);
+    if (err)
+        return err;
+    if (sl[0].numa)
+        err = dmem_numa_thread_attr(sl[0].numa, &attr);
+    for ( ; !err && started < nsl; started++) {
+        err = pthread_create(&sl[started].tid, &attr, mt_thread, &sl[started]);
+        if (err)
+            break;
+    }
+    pthread_attr_destroy(&attr);
+    if (first && !err)
+        mt_thread(&sl[0]);
+    for (i = first; i < started; i++)
+        pthread_join(sl[i].tid, NULL);
+    return err;
+}
+
+static int mt_region(dmem_mapping_hnd_t dp, dmem_mapping_size_t off, dmem_mapping_size_t *size,
+                     volatile uint32_t **pp)
+{
+    if ((off | *size) & (sizeof(uint32_t) - 1))
+        return EINVAL;
+    if (off >= dp->map_size)
+        return ERANGE;
+    if (*size == 0)
+        *size = (dp->map_size - off) & ~(dmem_mapping_size_t)(sizeof(uint32_t) - 1);
+    *pp = (volatile uint32_t *)dmem_get_pointer(dp, off, *size);
+    if (!*pp)
+        return ERANGE;
+    return 0;
+}
+
+// Add e to the sorted error list, keep the max lowest offsets.
+// Equal offsets stay in the order they were found.
+static void mt_keep_error(struct dmem_mtest_params_s *tp, const struct dmem_mtest_error_s *e)
+{
+    unsigned pos = tp->n_errors;
+
+    while (pos > 0 && tp->errors[pos - 1].offset > e->offset)
+        pos--;
+    if (pos >= tp->max_errors)
+        return;
+    if (tp->n_errors < tp->max_errors)
+        tp->n_errors++;
+    memmove(&tp->errors[pos + 1], &tp->errors[pos], (tp->n_errors - 1 - pos) * sizeof(*e));
+    tp->errors[pos] = *e;
+}
+
+int dmem_mtest_run(dmem_mapping_hnd_t dp, struct dmem_mtest_params_s *tp)
+{
+    volatile uint32_t *p;
+    struct mt_slice_s *sl;
+    dmem_mapping_size_t size;
+    size_t nwords, per;
+    unsigned nthreads, nsl, i, bit, pass;
+    int err;
+
+    if (!dp || !tp)
+        return -1;
+    if (dp->flags & MF_READONLY)
+        return EACCES;
+    if (tp->max_errors && !tp->errors)
+        return EINVAL;
+    if (tp->numa && tp->numa->ncpus == 0)
+        return ENODEV;
+
+    size = tp->size;
+    err = mt_region(dp, tp->off, &size, &p);
+    if (err)
+        return err;
+    nwords = size / sizeof(uint32_t);
+
+    nthreads = tp->nthreads;
+    if (nthreads == 0 && tp->numa)
+        nthreads = (unsigned)tp->numa->ncpus;
+    if (nthreads == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? (unsigned)ncpu : 1;
+    }
+    if (nthreads > nwords / MT_MIN_SLICE)
+        nthreads = nwords / MT_MIN_SLICE;
+    if (nthreads == 0)
+        nthreads = 1;
+
+    sl = calloc(nthreads, sizeof(*sl));
+    if (!sl)
+        return ENOMEM;
+    if (tp->max_errors) {
+        sl[0].errs = calloc((size_t)nthreads * tp->max_errors, sizeof(*sl[0].errs));
+        if (!sl[0].errs) {
+            free(sl);
+            return ENOMEM;
+        }
+    }
+
+    per = (nwords + nthreads - 1) / nthreads;
+    per = (per + MT_SLICE_ALIGN - 1) & ~(size_t)(MT_SLICE_ALIGN - 1);
+    for (nsl = 0; nsl < nthreads && nsl * per < nwords; nsl++) {
+        sl[nsl].p = p + nsl * per;
+        sl[nsl].n = (nsl + 1) * per <= nwords ? per : nwords - nsl * per;
+        sl[nsl].gidx = tp->off / sizeof(uint32_t) + nsl * per;
+        sl[nsl].seed = tp->seed;
+        sl[nsl].errs = sl[0].errs ? sl[0].errs + (size_t)nsl * tp->max_errors : NULL;
+        sl[nsl].max_errs = tp->max_errors;
+        sl[nsl].numa = tp->numa;
+    }
+
+    tp->n_errors = 0;
+    tp->total_errors = 0;
+    if (tp->patterns == 0)
+        tp->patterns = MT_ALL;
+
+    for (bit = 1; bit <= MT_RANDOM && !err; bit <<= 1) {
+        if (!(tp->patterns & bit))
+            continue;
+        for (pass = 0; pass < mt_passes(bit) && !err; pass++) {
+            for (i = 0; i < nsl; i++) {
+                sl[i].pattern = bit;
+                sl[i].pass = pass;
+                sl[i].verify = 0;
+            }
+            err = mt_run_phase(sl, nsl);
+            if (err)
+                break;
+            __sync_synchronize();
+            for (i = 0; i < nsl; i++) {
+                sl[i].verify = 1;
+                sl[i].n_errs = 0;
+                sl[i].n_bad = 0;
+            }
+            err = mt_run_phase(sl, nsl);
+
+            for (i = 0; i < nsl; i++) {
+                unsigned k;
+                tp->total_errors += sl[i].n_bad;
+                for (k = 0; k < sl[i].n_errs; k++)
+                    mt_keep_error(tp, &sl[i].errs[k]);
+            }
+        }
+    }
+
+    free(sl[0].errs);
+    free(sl);
+    return err;
+}
+
+//============================================================================
+// Background scrub
+//============================================================================
+
+struct dmem_scrub_s {
+    pthread_t tid;
+    volatile uint32_t *p;
+    size_t n;               // words
+    uint32_t gidx;
+    uint64_t rate;          // bytes/s, 0 = unlimited
+    unsigned flags;
+    unsigned pattern;
+    uint32_t pass;          // last pass of the pattern, for SCRUB_VERIFY
+    uint32_t seed;
+    int stop;
+    uint64_t bytes;         // stats, written by the scrub thread only
+    uint64_t passes;
+    uint64_t errors;
+    dmem_mapping_size_t last_err_off;
+};
+
+static void scrub_error(struct dmem_scrub_s *h, uint32_t idx)
+{
+    __atomic_store_n(&h->last_err_off, (dmem_mapping_size_t)idx * sizeof(uint32_t), __ATOMIC_RELAXED);
+    __atomic_store_n(&h->errors, h->errors + 1, __ATOMIC_RELAXED);
+}
+
+// Scrub words [i, i+n) of the region. Expected values are from the last test pass.
+static MT_INLINE void scrub_chunk_k(unsigned pattern, struct dmem_scrub_s *h, size_t i, size_t n)
+{
+    volatile uint32_t *p = h->p;
+    const int wb = !!(h->flags & SCRUB_WRITEBACK);
+    const int vf = !!(h->flags & SCRUB_VERIFY);
+    size_t end = i + n;
+    uint32_t a;
+
+    for ( ; i < end && ((uintptr_t)(p + i) & (sizeof(v4u32) - 1)); i++) {
+        a = p[i];
+        if (vf && a != mt_gen1(pattern, h->pass, h->seed, h->gidx + i))
+            scrub_error(h, h->gidx + i);
+        if (wb)
+            p[i] = a;
+    }
+    for ( ; i + MT_VEC_WORDS <= end; i += MT_VEC_WORDS) {
+        v4u32 va = *(volatile v4u32 *)(p + i);
+        if (vf) {
+            v4u32 d = va ^ mt_gen(pattern, h->pass, h->seed, v_iota + (uint32_t)(h->gidx + i));
+            int k;
+            for (k = 0; k < MT_VEC_WORDS; k++) {
+                if (d[k])
+                    scrub_error(h, h->gidx + i + k);
+            }
+        }
+        if (wb)
+            *(volatile v4u32 *)(p + i) = va;
+    }
+    for ( ; i < end; i++) {
+        a = p[i];
+        if (vf && a != mt_gen1(pattern, h->pass, h->seed, h->gidx + i))
+            scrub_error(h, h->gidx + i);
+        if (wb)
+            p[i] = a;
+    }
+}
+
+static uint64_t scrub_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void *scrub_thread(void *arg)
+{
+    struct dmem_scrub_s *h = (struct dmem_scrub_s *)arg;
+    size_t chunk = SCRUB_CHUNK;
+
+    // With low rate, use smaller steps so we sleep ~10 ms at a time
+    if (h->rate && h->rate / 100 / sizeof(uint32_t) < chunk)
+        chunk = h->rate / 100 / sizeof(uint32_t);
+    if (chunk < MT_VEC_WORDS * 4)
+        chunk = MT_VEC_WORDS * 4;
+
+    while (!__atomic_load_n(&h->stop, __ATOMIC_RELAXED)) {
+        uint64_t t0 = scrub_now_ns();
+        uint64_t pass_bytes = 0;
+        size_t i, n;
+
+        for (i = 0; i < h->n; i += n) {
+            if (__atomic_load_n(&h->stop, __ATOMIC_RELAXED))
+                return NULL;
+            n = h->n - i < chunk ? h->n - i : chunk;
+            MT_DISPATCH(h->pattern, scrub_chunk_k, h, i, n);
+            pass_bytes += n * sizeof(uint32_t);
+            __atomic_store_n(&h->bytes, h->bytes + n * sizeof(uint32_t), __ATOMIC_RELAXED);
+
+            if (h->rate) {
+                // Region is < 4 GB, so pass_bytes * 1e9 fits in 64 bits
+                uint64_t due = pass_bytes * 1000000000u / h->rate;
+                uint64_t el = scrub_now_ns() - t0;
+                if (due > el) {
+                    struct timespec ts;
+                    ts.tv_sec = (due - el) / 1000000000u;
+                    ts.tv_nsec = (due - el) % 1000000000u;
+                    nanosleep(&ts, NULL);
+                }
+            }
+        }
+        __atomic_store_n(&h->passes, h->passes + 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+int dmem_scrub_start(dmem_mapping_hnd_t dp, dmem_mapping_size_t off, dmem_mapping_size_t size,
+                     uint64_t bytes_per_sec, unsigned flags,
+                     unsigned pattern, uint32_t seed,
+                     const struct dmem_numa_info_s *numa, dmem_scrub_hnd_t *ph)
+{
+    volatile uint32_t *p;
+    struct dmem_scrub_s *h;
+    pthread_attr_t attr;
+    int err;
+
+    if (!dp || !ph)
+        return -1;
+    *ph = NULL;
+    if ((flags & SCRUB_WRITEBACK) && (dp->flags & MF_READONLY))
+        return EACCES;
+    if (flags & SCRUB_VERIFY) {
+        // exactly one known pattern
+        if (!pattern || (pattern & (pattern - 1)) || (pattern & ~MT_ALL))
+            return EINVAL;
+    }
+
+    err = mt_region(dp, off, &size, &p);
+    if (err)
+        return err;
+
+    h = calloc(1, sizeof(*h));
+    if (!h)
+        return ENOMEM;
+    h->p = p;
+    h->n = size / sizeof(uint32_t);
+    h->gidx = off / sizeof(uint32_t);
+    h->rate = bytes_per_sec;
+    h->flags = flags;
+    h->pattern = pattern;
+    h->pass = mt_passes(pattern) - 1;
+    h->seed = seed;
+
+    // Pin at creation, so a failure is returned here
+    err = pthread_attr_init(&attr);
+    if (err) {
+        free(h);
+        return err;
+    }
+    if (numa)
+        err = dmem_numa_thread_attr(numa, &attr);
+    if (!err)
+        err = pthread_create(&h->tid, &attr, scrub_thread, h);
+    pthread_attr_destroy(&attr);
+    if (err) {
+        free(h);
+        return err;
+    }
+    *ph = h;
+    return 0;
+}
+
+int dmem_scrub_stats(dmem_scrub_hnd_t h, uint64_t *bytes, uint64_t *passes,
+                     uint64_t *errors, dmem_mapping_size_t *last_err_off)
+{
+    if (!h)
+        return -1;
+    if (bytes)
+        *bytes = __atomic_load_n(&h->bytes, __ATOMIC_RELAXED);
+    if (passes)
+        *passes = __atomic_load_n(&h->passes, __ATOMIC_RELAXED);
+    if (errors)
+        *errors = __atomic_load_n(&h->errors, __ATOMIC_RELAXED);
+    if (last_err_off)
+        *last_err_off = __atomic_load_n(&h->last_err_off, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int dmem_scrub_stop(dmem_scrub_hnd_t h)
+{
+    if (!h)
+        return -1;
+    __atomic_store_n(&h->stop, 1, __ATOMIC_RELAXED);
+    pthread_join(h->tid, NULL);
+    free(h);
+    return 0;
+}
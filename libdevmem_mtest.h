@@ -0,0 +1,99 @@
+/**
+* libdevmem extras: memory test and scrub engine for device DRAM
+* exposed through a mapping.
+*
+* Fill/verify kernels use 128-bit accesses and the region is split
+* between worker threads. Needs -pthread (see libdevmem-config --libs).
+*/
+
+#ifndef libdevmem_mtest_h_
+#define libdevmem_mtest_h_
+
+#include "libdevmem.h"
+#include "libdevmem_numa.h"
+
+// Test patterns, can be OR'ed. MT_WALKING_* run 32 passes, so each bit of
+// every cell is written once as 1 (or 0). The others run 2 passes: the
+// second inverts or swaps the first so every bit sees both values.
+enum dmem_mtest_pattern {
+    MT_WALKING_ONES  = 0x01, // word i = 1 << ((i + pass) % 32), pass 0..31
+    MT_WALKING_ZEROS = 0x02, // inverse of MT_WALKING_ONES
+    MT_ADDRESS       = 0x04, // word = its own offset in the mapping, then inverted
+    MT_CHECKERBOARD  = 0x08, // alternating 0x55555555/0xAAAAAAAA, then swapped
+    MT_RANDOM        = 0x10, // pseudo-random from the seed, reproducible, then inverted
+    MT_ALL           = 0x1F,
+};
+
+struct dmem_mtest_error_s {
+    dmem_mapping_size_t offset;   // offset from the mapping base
+    uint32_t expected;
+    uint32_t actual;
+    unsigned pattern;             // dmem_mtest_pattern bit of the failed pass
+};
+
+struct dmem_mtest_params_s {
+    unsigned patterns;            // in  dmem_mtest_pattern mask, 0 = MT_ALL
+    dmem_mapping_size_t off;      // in  start offset, 4-byte aligned
+    dmem_mapping_size_t size;     // in  bytes, multiple of 4; 0 = up to end of mapping
+    unsigned nthreads;            // in  0 = number of online (or device local) CPUs
+    uint32_t seed;                // in  for MT_RANDOM
+    unsigned max_errors;          // in  size of errors[] array, can be 0
+    struct dmem_mtest_error_s *errors; // in  caller's array: mismatches with the lowest offsets,
+                                  //     in address order (same offset: in test order)
+    const struct dmem_numa_info_s *numa; // in  optional, run workers on the device local CPUs;
+                                  //     ENODEV if it has no CPUs
+    unsigned n_errors;            // out number of entries stored in errors[]
+    uint64_t total_errors;        // out total mismatched words, all passes
+};
+
+enum dmem_scrub_flags {
+    SCRUB_WRITEBACK = 0x01, // write back every word read (refresh ECC)
+    SCRUB_VERIFY    = 0x02, // compare against pattern + seed left by a test
+};
+
+typedef struct dmem_scrub_s *dmem_scrub_hnd_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Run memory test over a region of the mapping.
+// Destroys the content of the region.
+// @param[in] dp  - mapping, after successfull dmem_mapping_map(); not MF_READONLY
+// @param[in,out] tp - test parameters and results
+// @return error code; 0 when the test completed (check tp->total_errors)
+int dmem_mtest_run(dmem_mapping_hnd_t dp, struct dmem_mtest_params_s *tp);
+
+// Start background scrub of a region in a separate thread.
+// The region is read in a loop with at most bytes_per_sec bandwidth.
+// With SCRUB_VERIFY, pattern (one dmem_mtest_pattern bit) and seed describe
+// the content left by the last pass of dmem_mtest_run() with only this pattern.
+// @param[in]  dp    - mapping, after successfull dmem_mapping_map()
+// @param[in]  off, size - region, as in dmem_mtest_params_s
+// @param[in]  bytes_per_sec - rate limit, 0 = unlimited
+// @param[in]  flags - dmem_scrub_flags
+// @param[in]  numa  - optional, run the scrub thread on the device local CPUs;
+//                     ENODEV if it has no CPUs
+// @param[out] ph    - scrub handle
+// @return error code
+int dmem_scrub_start(dmem_mapping_hnd_t dp, dmem_mapping_size_t off, dmem_mapping_size_t size,
+                     uint64_t bytes_per_sec, unsigned flags,
+                     unsigned pattern, uint32_t seed,
+                     const struct dmem_numa_info_s *numa, dmem_scrub_hnd_t *ph);
+
+// Get scrub progress. Any of the out pointers can be NULL.
+// @param[out] bytes  - bytes scrubbed so far
+// @param[out] passes - complete passes over the region
+// @param[out] errors - mismatches found with SCRUB_VERIFY
+// @param[out] last_err_off - offset of the last mismatch
+int dmem_scrub_stats(dmem_scrub_hnd_t h, uint64_t *bytes, uint64_t *passes,
+                     uint64_t *errors, dmem_mapping_size_t *last_err_off);
+
+// Stop the scrub thread and free the handle
+int dmem_scrub_stop(dmem_scrub_hnd_t h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* libdevmem_mtest_h_ */
@@ -0,0 +1,248 @@
+/**
+* libdevmem extras: NUMA locality of the device
+*
+* No libnuma dependency: memory policy is set with the mbind syscall.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "libdevmem_numa.h" /* self */
+
+#define PCI_SYSFS_DIR "/sys/bus/pci/devices"
+
+#define NUMA_MAX_NODES 1024
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+static int numa_cpu_set(struct dmem_numa_info_s *info, unsigned cpu)
+{
+    if (cpu >= DMEM_NUMA_MAX_CPUS)
+        return -1;
+    if (!(info->local_cpus[cpu / 64] & (1ULL << (cpu % 64)))) {
+        info->local_cpus[cpu / 64] |= 1ULL << (cpu % 64);
+        info->ncpus++;
+    }
+    return 0;
+}
+
+static int numa_cpu_isset(const struct dmem_numa_info_s *info, unsigned cpu)
+{
+    if (cpu >= DMEM_NUMA_MAX_CPUS)
+        return 0;
+    return !!(info->local_cpus[cpu / 64] & (1ULL << (cpu % 64)));
+}
+
+// Parse cpulist like "0-7,16-23"
+static int numa_parse_cpulist(struct dmem_numa_info_s *info, const char *s)
+{
+    char *endp;
+    unsigned long a, b;
+
+    while (*s && *s != '\n') {
+        a = strtoul(s, &endp, 10);
+        if (endp == s)
+            return EINVAL;
+        b = a;
+        s = endp;
+        if (*s == '-') {
+            s++;
+            b = strtoul(s, &endp, 10);
+            if (endp == s || b < a)
+                return EINVAL;
+            s = endp;
+        }
+        for ( ; a <= b; a++)
+            numa_cpu_set(info, (unsigned)a);
+        if (*s == ',')
+            s++;
+    }
+    return 0;
+}
+
+static int numa_read_line(const char *devpath, const char *name, char *buf, size_t size)
+{
+    char path[sizeof(PCI_SYSFS_DIR) + 256 + 16];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", devpath, name);
+    f = fopen(path, "r");
+    if (!f)
+        return errno;
+    if (!fgets(buf, (int)size, f)) {
+        fclose(f);
+        return EIO;
+    }
+    fclose(f);
+    return 0;
+}
+
+int dmem_numa_info_from_sysfs(const char *devpath, struct dmem_numa_info_s *info)
+{
+    char buf[1024];
+    const char *name;
+    int err;
+
+    if (!devpath || !info)
+        return -1;
+    memset(info, 0, sizeof(*info));
+    info->node = -1;
+
+    name = strrchr(devpath, '/');
+    name = name ? name + 1 : devpath;
+    snprintf(info->pci_dev, sizeof(info->pci_dev), "%s", name);
+
+    err = numa_read_line(devpath, "numa_node", buf, sizeof(buf));
+    if (err)
+        return err;
+    info->node = atoi(buf);
+
+    err = numa_read_line(devpath, "local_cpulist", buf, sizeof(buf));
+    if (err)
+        return err;
+    return numa_parse_cpulist(info, buf);
+}
+
+// Check if one of the device BARs (sysfs "resource" file) contains pha
+static int numa_dev_has_addr(const char *devpath, uint64_t pha)
+{
+    char path[sizeof(PCI_SYSFS_DIR) + 256 + 16], line[128];
+    unsigned long long start, end, flags;
+    int found = 0, bar;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/resource", devpath);
+    f = fopen(path, "r");
+    if (!f)
+        return 0;
+    // Only lines 0-5 are BARs; the rest are the ROM and, for bridges,
+    // windows that contain the BARs of the devices behind them.
+    for (bar = 0; !found && bar < 6 && fgets(line, sizeof(line), f); bar++) {
+        if (sscanf(line, "%llx %llx %llx", &start, &end, &flags) != 3)
+            continue;
+        if (start == 0 && end == 0) // empty BAR
+            continue;
+        found = (start <= pha && pha <= end);
+    }
+    fclose(f);
+    return found;
+}
+
+int dmem_numa_get_info(dmem_mapping_hnd_t dp, struct dmem_numa_info_s *info)
+{
+    char devpath[sizeof(PCI_SYSFS_DIR) + 256];
+    struct dirent *de;
+    dmem_phys_address_t pha;
+    DIR *d;
+    int err = ENODEV;
+
+    if (!dp || !info)
+        return -1;
+    pha = dmem_get_phys_addr(dp);
+    if (pha == (dmem_phys_address_t)(-1L))
+        return EINVAL;
+
+    d = opendir(PCI_SYSFS_DIR);
+    if (!d)
+        return errno;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(devpath, sizeof(devpath), "%s/%s", PCI_SYSFS_DIR, de->d_name);
+        if (numa_dev_has_addr(devpath, pha)) {
+            err = dmem_numa_info_from_sysfs(devpath, info);
+            break;
+        }
+    }
+    closedir(d);
+    return err;
+}
+
+static int numa_cpuset(const struct dmem_numa_info_s *info, cpu_set_t *cs)
+{
+    unsigned cpu;
+
+    if (info->ncpus == 0)
+        return ENODEV;
+    CPU_ZERO(cs);
+    for (cpu = 0; cpu < DMEM_NUMA_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if (numa_cpu_isset(info, cpu))
+            CPU_SET(cpu, cs);
+    }
+    return 0;
+}
+
+int dmem_numa_pin_thread(const struct dmem_numa_info_s *info)
+{
+    cpu_set_t cs;
+    int err;
+
+    if (!info)
+        return -1;
+    err = numa_cpuset(info, &cs);
+    if (err)
+        return err;
+    return pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs);
+}
+
+int dmem_numa_thread_attr(const struct dmem_numa_info_s *info, pthread_attr_t *attr)
+{
+    cpu_set_t cs;
+    int err;
+
+    if (!info || !attr)
+        return -1;
+    err = numa_cpuset(info, &cs);
+    if (err)
+        return err;
+    return pthread_attr_setaffinity_np(attr, sizeof(cs), &cs);
+}
+
+int dmem_numa_is_local(const struct dmem_numa_info_s *info)
+{
+    int cpu;
+
+    if (!info || info->ncpus == 0)
+        return -1;
+    cpu = sched_getcpu();
+    if (cpu < 0)
+        return -1;
+    return numa_cpu_isset(info, (unsigned)cpu);
+}
+
+void *dmem_numa_alloc(const struct dmem_numa_info_s *info, size_t size)
+{
+    void *p;
+
+    if (size == 0)
+        return NULL;
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    if (info && info->node >= 0 && info->node < NUMA_MAX_NODES) {
+        unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))];
+        memset(mask, 0, sizeof(mask));
+        mask[info->node / (8 * sizeof(unsigned long))] |= 1UL << (info->node % (8 * sizeof(unsigned long)));
+        // Pages are placed on first touch; if mbind fails they go to the default node
+        (void)syscall(SYS_mbind, p, size, MPOL_PREFERRED, mask, sizeof(mask) * 8 + 1, 0);
+    }
+    return p;
+}
+
+void dmem_numa_free(void *p, size_t size)
+{
+    if (p)
+        munmap(p, size);
+}
@@ -0,0 +1,62 @@
+/**
+* libdevmem extras: NUMA locality of the device
+*
+* The PCI device that owns the mapping is found in sysfs by its BAR
+* addresses, and its numa_node and local_cpulist are used to pin threads
+* and place host buffers on the device's node.
+*/
+
+#ifndef libdevmem_numa_h_
+#define libdevmem_numa_h_
+
+#include <stddef.h>
+#include <pthread.h>
+#include "libdevmem.h"
+
+#define DMEM_NUMA_MAX_CPUS 1024
+
+struct dmem_numa_info_s {
+    int node;               // NUMA node of the device, -1 = unknown or not a NUMA system
+    int ncpus;              // number of CPUs in local_cpus
+    char pci_dev[16];       // device name in /sys/bus/pci/devices, ex "0000:03:00.0"
+    uint64_t local_cpus[DMEM_NUMA_MAX_CPUS / 64]; // CPU bitmask from local_cpulist
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Get locality of the mapping: find the PCI device with a BAR that
+// contains the mapping physical address.
+// @param[in]  dp   - mapping, after successfull dmem_mapping_map()
+// @param[out] info - device locality
+// @return error code, ENODEV if no PCI device has this address
+int dmem_numa_get_info(dmem_mapping_hnd_t dp, struct dmem_numa_info_s *info);
+
+// Same, for a known device sysfs path, ex "/sys/bus/pci/devices/0000:03:00.0"
+int dmem_numa_info_from_sysfs(const char *devpath, struct dmem_numa_info_s *info);
+
+// Pin the calling thread to the device local CPUs
+// @return error code
+int dmem_numa_pin_thread(const struct dmem_numa_info_s *info);
+
+// Set the affinity of threads created with attr to the device local CPUs.
+// An affinity the system rejects makes pthread_create() fail.
+// @return error code, ENODEV if info has no CPUs
+int dmem_numa_thread_attr(const struct dmem_numa_info_s *info, pthread_attr_t *attr);
+
+// Check if the calling thread currently runs on a device local CPU
+// @return 1 = local, 0 = remote, -1 = unknown
+int dmem_numa_is_local(const struct dmem_numa_info_s *info);
+
+// Allocate page aligned host memory (staging, bounce buffers) on the device node.
+// Falls back to normal allocation if the node is unknown.
+// @return pointer or NULL. Free with dmem_numa_free()
+void *dmem_numa_alloc(const struct dmem_numa_info_s *info, size_t size);
+void  dmem_numa_free(void *p, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* libdevmem_numa_h_ */
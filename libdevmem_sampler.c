@@ -0,0 +1,459 @@
+/**
+* libdevmem extras: periodic register sampler with binary log
+*
+* The schedule is absolute: sample k is due at ts0 + k * period, so
+* the rate does not drift with the loop overhead. The thread sleeps
+* until shortly before the deadline, then spins. Timestamps are the TSC
+* on x86 (calibrated against CLOCK_MONOTONIC at start; assumes invariant
+* TSC), CLOCK_MONOTONIC ns elsewhere.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define SMP_HAVE_TSC 1
+#endif
+
+#include "libdevmem_sampler.h" /* self */
+
+#define SMP_SPIN_NS      100000  // spin for the last 100 us before deadline
+#define SMP_HINT_EVERY   1024    // records between header n_records updates
+#define SMP_CALIBRATE_NS 20000000
+
+struct smp_probe_s {
+    volatile void *p;
+    unsigned width;
+};
+
+struct dmem_sampler_s {
+    pthread_t tid;
+    int fd;
+    uint8_t *base;          // log mapping
+    size_t size;
+    struct dmem_slog_hdr_s *hdr;
+    struct smp_probe_s probes[DMEM_SAMPLER_MAX_PROBES];
+    unsigned nprobes;
+    uint64_t period;        // ts ticks
+    int stop;
+    int full;
+    uint64_t records;       // stats, written by the sampler thread only
+    uint64_t missed;
+};
+
+static uint64_t smp_now_ns(clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static inline uint64_t smp_ts(void)
+{
+#if SMP_HAVE_TSC
+    return __rdtsc();
+#else
+    return smp_now_ns(CLOCK_MONOTONIC);
+#endif
+}
+
+static inline void smp_cpu_relax(void)
+{
+#if SMP_HAVE_TSC
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static uint64_t smp_ts_hz(void)
+{
+#if SMP_HAVE_TSC
+    struct timespec d = { 0, SMP_CALIBRATE_NS };
+    uint64_t t0 = smp_now_ns(CLOCK_MONOTONIC), c0 = __rdtsc();
+    uint64_t t1, c1;
+    nanosleep(&d, NULL);
+    t1 = smp_now_ns(CLOCK_MONOTONIC);
+    c1 = __rdtsc();
+    return (uint64_t)((double)(c1 - c0) * 1e9 / (double)(t1 - t0));
+#else
+    return 1000000000u;
+#endif
+}
+
+static inline uint32_t smp_read(const struct smp_probe_s *pr)
+{
+    switch (pr->width) {
+    case 1:  return *(volatile uint8_t *)pr->p;
+    case 2:  return *(volatile uint16_t *)pr->p;
+    default: return *(volatile uint32_t *)pr->p;
+    }
+}
+
+// CPUs for the sampler thread, from the parameters.
+// @return 0 if no pinning, 1 if cs is set, or -errno
+static int smp_cpuset(const struct dmem_sampler_params_s *sp, cpu_set_t *cs)
+{
+    unsigned cpu;
+
+    CPU_ZERO(cs);
+    if (sp->flags & SMP_PIN_CPU) {
+        if (sp->cpu < 0 || sp->cpu >= CPU_SETSIZE)
+            return -EINVAL;
+        CPU_SET(sp->cpu, cs);
+        return 1;
+    }
+    if (!sp->numa)
+        return 0;
+    if (sp->numa->ncpus == 0)
+        return -ENODEV;
+    for (cpu = 0; cpu < DMEM_NUMA_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if ((sp->numa->local_cpus[cpu / 64] >> (cpu % 64)) & 1)
+            CPU_SET(cpu, cs);
+    }
+    return 1;
+}
+
+// Largest log that fits in both size_t (mapping) and off_t (file)
+static uint64_t smp_max_size(void)
+{
+    uint64_t off_max = ((uint64_t)1 << (sizeof(off_t) * 8 - 1)) - 1;
+    return (uint64_t)SIZE_MAX < off_max ? (uint64_t)SIZE_MAX : off_max;
+}
+
+// Wait until ts >= deadline. Returns 1 if asked to stop.
+static int smp_wait(struct dmem_sampler_s *h, uint64_t deadline)
+{
+    const uint64_t hz = h->hdr->ts_hz;
+    uint64_t now = smp_ts();
+
+    if (deadline > now) {
+        uint64_t ns = (uint64_t)((double)(deadline - now) * 1e9 / (double)hz);
+        if (ns > 2 * SMP_SPIN_NS) {
+            struct timespec d;
+            ns -= SMP_SPIN_NS;
+            d.tv_sec = ns / 1000000000u;
+            d.tv_nsec = ns % 1000000000u;
+            nanosleep(&d, NULL);
+        }
+    }
+    while (smp_ts() < deadline) {
+        if (__atomic_load_n(&h->stop, __ATOMIC_RELAXED))
+            return 1;
+        smp_cpu_relax();
+    }
+    return __atomic_load_n(&h->stop, __ATOMIC_RELAXED);
+}
+
+static void *smp_thread(void *arg)
+{
+    struct dmem_sampler_s *h = (struct dmem_sampler_s *)arg;
+    struct dmem_slog_hdr_s *hdr = h->hdr;
+    uint8_t *rec = h->base + hdr->hdr_size;
+    uint64_t k = 0, n = 0, ts0;
+    unsigned j;
+
+    ts0 = smp_ts();
+    hdr->ts0 = ts0;
+    hdr->realtime0_ns = (int64_t)smp_now_ns(CLOCK_REALTIME);
+
+    while (n < hdr->capacity) {
+        uint64_t deadline = ts0 + k * h->period;
+        uint64_t now = smp_ts();
+        uint64_t ts;
+
+        // Too late for one or more slots: skip them, keep the schedule
+        if (now >= deadline + h->period) {
+            uint64_t skip = (now - deadline) / h->period;
+            k += skip;
+            deadline += skip * h->period;
+            __atomic_store_n(&h->missed, h->missed + skip, __ATOMIC_RELAXED);
+        }
+        if (smp_wait(h, deadline))
+            break;
+
+        ts = smp_ts();
+        for (j = 0; j < h->nprobes; j++)
+            ((struct dmem_slog_rec_s *)rec)->v[j] = smp_read(&h->probes[j]);
+        // Commit: ts last
+        __atomic_store_n(&((struct dmem_slog_rec_s *)rec)->ts, ts ? ts : 1, __ATOMIC_RELEASE);
+
+        rec += hdr->rec_size;
+        n++;
+        k++;
+        __atomic_store_n(&h->records, n, __ATOMIC_RELAXED);
+        if ((n % SMP_HINT_EVERY) == 0) {
+            __atomic_store_n(&hdr->n_records, n, __ATOMIC_RELAXED);
+            hdr->missed = h->missed;
+        }
+    }
+
+    if (n >= hdr->capacity)
+        __atomic_store_n(&h->full, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hdr->n_records, n, __ATOMIC_RELAXED);
+    hdr->missed = h->missed;
+    return NULL;
+}
+
+int dmem_sampler_start(const char *logpath, const struct dmem_sampler_params_s *sp, dmem_sampler_hnd_t *ph)
+{
+    struct dmem_sampler_s *h;
+    struct dmem_slog_probe_s *lp;
+    uint32_t hdr_size, rec_size;
+    pthread_attr_t attr;
+    cpu_set_t cs;
+    unsigned j;
+    int err, pin;
+
+    if (!logpath || !sp || !ph)
+        return -1;
+    *ph = NULL;
+    if (!sp->probes || sp->nprobes == 0 || sp->nprobes > DMEM_SAMPLER_MAX_PROBES ||
+        sp->rate_hz == 0 || sp->capacity == 0)
+        return EINVAL;
+    pin = smp_cpuset(sp, &cs);
+    if (pin < 0)
+        return -pin;
+
+    h = calloc(1, sizeof(*h));
+    if (!h)
+        return ENOMEM;
+    h->fd = -1;
+    h->nprobes = sp->nprobes;
+
+    for (j = 0; j < sp->nprobes; j++) {
+        const struct dmem_probe_s *pr = &sp->probes[j];
+        if (!pr->dp || (pr->width != 1 && pr->width != 2 && pr->width != 4) ||
+            (pr->off & (pr->width - 1))) {
+            err = EINVAL;
+            goto fail;
+        }
+        h->probes[j].p = dmem_get_pointer(pr->dp, pr->off, pr->width);
+        h->probes[j].width = pr->width;
+        if (!h->probes[j].p) {
+            err = ERANGE;
+            goto fail;
+        }
+    }
+
+    hdr_size = sizeof(struct dmem_slog_hdr_s) + sp->nprobes * sizeof(struct dmem_slog_probe_s);
+    hdr_size = (hdr_size + 63) & ~63u;
+    rec_size = sizeof(struct dmem_slog_rec_s) + sp->nprobes * sizeof(uint32_t);
+    rec_size = (rec_size + 7) & ~7u;
+    if (sp->capacity > (smp_max_size() - hdr_size) / rec_size) {
+        err = EFBIG;
+        goto fail;
+    }
+    h->size = hdr_size + sp->capacity * rec_size;
+
+    h->fd = open(logpath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (h->fd == -1) {
+        err = errno;
+        goto fail;
+    }
+    // Allocate the blocks now; records read as zeros = not written
+    err = posix_fallocate(h->fd, 0, (off_t)h->size);
+    if (err)
+        goto fail;
+    h->base = mmap(NULL, h->size, PROT_READ | PROT_WRITE, MAP_SHARED, h->fd, 0);
+    if (h->base == MAP_FAILED) {
+        h->base = NULL;
+        err = errno;
+        goto fail;
+    }
+
+    h->hdr = (struct dmem_slog_hdr_s *)h->base;
+    h->hdr->version = DMEM_SLOG_VERSION;
+    h->hdr->hdr_size = hdr_size;
+    h->hdr->rec_size = rec_size;
+    h->hdr->nprobes = sp->nprobes;
+    h->hdr->rate_hz = sp->rate_hz;
+    h->hdr->capacity = sp->capacity;
+    h->hdr->ts_hz = smp_ts_hz();
+    lp = (struct dmem_slog_probe_s *)(h->hdr + 1);
+    for (j = 0; j < sp->nprobes; j++) {
+        dmem_phys_address_t pha = dmem_get_phys_addr(sp->probes[j].dp);
+        lp[j].off = sp->probes[j].off;
+        lp[j].width = sp->probes[j].width;
+        lp[j].phys_addr = pha == (dmem_phys_address_t)(-1L) ? pha : pha + sp->probes[j].off;
+    }
+    __atomic_store_n(&h->hdr->magic, DMEM_SLOG_MAGIC, __ATOMIC_RELEASE);
+
+    h->period = h->hdr->ts_hz / sp->rate_hz;
+    if (h->period == 0)
+        h->period = 1;
+
+    // Set the affinity at creation, so a failure is returned here
+    err = pthread_attr_init(&attr);
+    if (err)
+        goto fail;
+    if (pin)
+        err = pthread_attr_setaffinity_np(&attr, sizeof(cs), &cs);
+    if (!err)
+        err = pthread_create(&h->tid, &attr, smp_thread, h);
+    pthread_attr_destroy(&attr);
+    if (err)
+        goto fail;
+    *ph = h;
+    return 0;
+
+fail:
+    if (h->base)
+        munmap(h->base, h->size);
+    if (h->fd != -1)
+        close(h->fd);
+    free(h);
+    return err;
+}
+
+int dmem_sampler_stats(dmem_sampler_hnd_t h, uint64_t *records, uint64_t *missed, int *full)
+{
+    if (!h)
+        return -1;
+    if (records)
+        *records = __atomic_load_n(&h->records, __ATOMIC_RELAXED);
+    if (missed)
+        *missed = __atomic_load_n(&h->missed, __ATOMIC_RELAXED);
+    if (full)
+        *full = __atomic_load_n(&h->full, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int dmem_sampler_stop(dmem_sampler_hnd_t h)
+{
+    int err = 0;
+
+    if (!h)
+        return -1;
+    __atomic_store_n(&h->stop, 1, __ATOMIC_RELAXED);
+    pthread_join(h->tid, NULL);
+    if (msync(h->base, h->size, MS_SYNC) != 0)
+        err = errno;
+    munmap(h->base, h->size);
+    close(h->fd);
+    free(h);
+    return err;
+}
+
+//============================================================================
+// Reader
+//============================================================================
+
+// Check the header against the file size, so record access stays in the mapping
+static int slog_hdr_valid(const struct dmem_slog_hdr_s *hdr, size_t size)
+{
+    const struct dmem_slog_hdr_s h = *hdr; // the writer may still update it
+
+    if (h.magic != DMEM_SLOG_MAGIC || h.version != DMEM_SLOG_VERSION)
+        return 0;
+    if (h.nprobes == 0 || h.nprobes > DMEM_SAMPLER_MAX_PROBES || h.capacity == 0 || h.ts_hz == 0)
+        return 0;
+    if (h.hdr_size < sizeof(h) + h.nprobes * sizeof(struct dmem_slog_probe_s) ||
+        h.rec_size < sizeof(struct dmem_slog_rec_s) + h.nprobes * sizeof(uint32_t) ||
+        ((h.hdr_size | h.rec_size) & 7) || h.hdr_size > size)
+        return 0;
+    return h.capacity <= (size - h.hdr_size) / h.rec_size;
+}
+
+int dmem_slog_open(const char *logpath, struct dmem_slog_s *lg)
+{
+    struct stat st;
+    int fd, err = 0;
+
+    if (!logpath || !lg)
+        return -1;
+    memset(lg, 0, sizeof(*lg));
+    fd = open(logpath, O_RDONLY);
+    if (fd == -1)
+        return errno;
+    if (fstat(fd, &st) != 0) {
+        err = errno;
+        goto out;
+    }
+    if (st.st_size < (off_t)sizeof(struct dmem_slog_hdr_s)) {
+        err = EINVAL;
+        goto out;
+    }
+    if ((uint64_t)st.st_size > (uint64_t)SIZE_MAX) {
+        err = EFBIG; // can't map it all in this process
+        goto out;
+    }
+    lg->size = (size_t)st.st_size;
+    lg->base = mmap(NULL, lg->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (lg->base == MAP_FAILED) {
+        lg->base = NULL;
+        err = errno;
+        goto out;
+    }
+    lg->hdr = (const struct dmem_slog_hdr_s *)lg->base;
+    if (!slog_hdr_valid(lg->hdr, lg->size)) {
+        munmap((void *)lg->base, lg->size);
+        memset(lg, 0, sizeof(*lg));
+        err = EINVAL;
+        goto out;
+    }
+    lg->probes = (const struct dmem_slog_probe_s *)(lg->hdr + 1);
+
+out:
+    close(fd);
+    return err;
+}
+
+const struct dmem_slog_rec_s *dmem_slog_record(const struct dmem_slog_s *lg, uint64_t i)
+{
+    const struct dmem_slog_rec_s *rec;
+
+    if (!lg->hdr || i >= lg->hdr->capacity)
+        return NULL;
+    rec = (const struct dmem_slog_rec_s *)(lg->base + lg->hdr->hdr_size + i * lg->hdr->rec_size);
+    if (__atomic_load_n(&rec->ts, __ATOMIC_ACQUIRE) == 0)
+        return NULL;
+    return rec;
+}
+
+uint64_t dmem_slog_count(const struct dmem_slog_s *lg)
+{
+    uint64_t lo, hi, mid;
+
+    if (!lg->hdr)
+        return 0;
+    // Valid records are a prefix of the log: binary search the end, from the hint
+    lo = __atomic_load_n(&lg->hdr->n_records, __ATOMIC_RELAXED);
+    if (lo > lg->hdr->capacity || (lo && !dmem_slog_record(lg, lo - 1)))
+        lo = 0;
+    hi = lg->hdr->capacity;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (dmem_slog_record(lg, mid))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+double dmem_slog_seconds(const struct dmem_slog_s *lg, const struct dmem_slog_rec_s *rec)
+{
+    return (double)(int64_t)(rec->ts - lg->hdr->ts0) / (double)lg->hdr->ts_hz;
+}
+
+int dmem_slog_close(struct dmem_slog_s *lg)
+{
+    if (!lg)
+        return -1;
+    if (lg->base)
+        munmap((void *)lg->base, lg->size);
+    memset(lg, 0, sizeof(*lg));
+    return 0;
+}
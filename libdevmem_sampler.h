@@ -0,0 +1,125 @@
+/**
+* libdevmem extras: periodic register sampler with binary log
+*
+* A sampler thread reads a list of probes (registers in mappings)
+* at a fixed rate and appends timestamped records to a memory-mapped
+* log file. Python reader: python/dmemlog.py
+*
+* Log file layout, little endian:
+*   struct dmem_slog_hdr_s
+*   struct dmem_slog_probe_s [nprobes]
+*   padding up to hdr_size
+*   records [capacity], rec_size bytes each: uint64_t ts; uint32_t v[nprobes]
+*
+* The file is preallocated (posix_fallocate) with room for capacity
+* records, so it is never resized while sampling and a full disk is
+* reported by dmem_sampler_start() rather than as SIGBUS later.
+* Unwritten records read as zeros. A record is valid when its ts is not 0:
+* ts is stored last, so a record torn by a crash of the writer reads as
+* end of log. n_records in the header is only a hint.
+*/
+
+#ifndef libdevmem_sampler_h_
+#define libdevmem_sampler_h_
+
+#include <stddef.h>
+#include "libdevmem.h"
+#include "libdevmem_numa.h"
+
+#define DMEM_SLOG_MAGIC      0x474F4C53 // "SLOG"
+#define DMEM_SLOG_VERSION    1
+#define DMEM_SAMPLER_MAX_PROBES 256
+
+struct dmem_probe_s {
+    dmem_mapping_hnd_t dp;        // mapping, after successfull dmem_mapping_map()
+    dmem_mapping_size_t off;      // register offset, aligned on width
+    unsigned width;               // 1, 2 or 4 bytes
+};
+
+enum dmem_sampler_flags {
+    SMP_PIN_CPU = 0x01, // use dmem_sampler_params_s::cpu
+};
+
+struct dmem_sampler_params_s {
+    const struct dmem_probe_s *probes;
+    unsigned nprobes;
+    uint32_t rate_hz;             // samples per second
+    uint64_t capacity;            // max. records in the log; sampling stops when full
+    unsigned flags;               // dmem_sampler_flags
+    int cpu;                      // with SMP_PIN_CPU: pin the sampler thread to this CPU
+    const struct dmem_numa_info_s *numa; // without SMP_PIN_CPU: pin to device local CPUs, can be NULL
+};
+
+// Log file header
+struct dmem_slog_hdr_s {
+    uint32_t magic;               // DMEM_SLOG_MAGIC
+    uint32_t version;             // DMEM_SLOG_VERSION
+    uint32_t hdr_size;            // offset of the first record
+    uint32_t rec_size;
+    uint32_t nprobes;
+    uint32_t rate_hz;
+    uint64_t capacity;            // records
+    uint64_t ts_hz;               // timestamp ticks per second (TSC or ns clock)
+    uint64_t ts0;                 // timestamp at start
+    int64_t  realtime0_ns;        // CLOCK_REALTIME at ts0, ns since the epoch
+    uint64_t n_records;           // hint, updated periodically and at stop
+    uint64_t missed;              // sample slots skipped because the sampler was late
+};
+
+struct dmem_slog_probe_s {
+    uint32_t off;                 // offset in the mapping
+    uint32_t width;
+    uint32_t phys_addr;           // physical address, (uint32_t)-1 if unknown
+    uint32_t reserved;
+};
+
+struct dmem_slog_rec_s {
+    uint64_t ts;                  // 0 = not written
+    uint32_t v[];                 // one per probe
+};
+
+// Reader state
+struct dmem_slog_s {
+    const struct dmem_slog_hdr_s *hdr;
+    const struct dmem_slog_probe_s *probes;
+    const uint8_t *base;
+    size_t size;
+};
+
+typedef struct dmem_sampler_s *dmem_sampler_hnd_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Create the log and start sampling
+// @param[in]  logpath - log file, created or truncated
+// @param[in]  sp      - sampler parameters
+// @param[out] ph      - sampler handle
+// @return error code; pinning the thread failed (e.g. EINVAL for a bad cpu) is an error
+int dmem_sampler_start(const char *logpath, const struct dmem_sampler_params_s *sp, dmem_sampler_hnd_t *ph);
+
+// Get sampler progress. Any of the out pointers can be NULL.
+// @param[out] records - records written
+// @param[out] missed  - sample slots skipped
+// @param[out] full    - 1 if the log is full and sampling stopped
+int dmem_sampler_stats(dmem_sampler_hnd_t h, uint64_t *records, uint64_t *missed, int *full);
+
+// Stop sampling, flush and close the log, free the handle
+int dmem_sampler_stop(dmem_sampler_hnd_t h);
+
+// Reader. Can be used while the sampler is running.
+int dmem_slog_open(const char *logpath, struct dmem_slog_s *lg);
+// Number of valid records now
+uint64_t dmem_slog_count(const struct dmem_slog_s *lg);
+// Record i, or NULL if not (yet) written
+const struct dmem_slog_rec_s *dmem_slog_record(const struct dmem_slog_s *lg, uint64_t i);
+// Record timestamp as seconds from the log start
+double dmem_slog_seconds(const struct dmem_slog_s *lg, const struct dmem_slog_rec_s *rec);
+int dmem_slog_close(struct dmem_slog_s *lg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* libdevmem_sampler_h_ */
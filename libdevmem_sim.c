@@ -0,0 +1,458 @@
+/**
+* libdevmem extras: simulated device, active register ranges
+*
+* Trap mode: the user view of the active pages is PROT_NONE. On SIGSEGV
+* the handler decodes the access width from the faulting instruction,
+* runs the read callback of every register in the access (results go
+* into the backing memory), unprotects the page and sets the trap flag,
+* so the instruction executes once on real memory. The SIGTRAP that
+* follows runs the write callback of every register in the access, and
+* of other changed words near it, then protects the page again.
+* Callbacks get the backing memory through the library's alias view.
+*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include "libdevmem_sim.h" /* self */
+
+#if defined(__x86_64__) && defined(__linux__)
+#define SIM_HAVE_TRAP 1
+#define SIM_EFL_TF    0x100 // EFLAGS trap flag
+#define SIM_PF_WRITE  0x2   // page fault error code: write access
+#endif
+
+#define SIM_WRITE_WINDOW 32 // bytes checked for changes after a trapped write
+#define SIM_DEF_WIDTH    4  // access width when the instruction is not decoded
+
+struct sim_range_s {
+    dmem_mapping_hnd_t dp;
+    char *user;             // range start in the user view (map_ptr + off)
+    uint32_t *alias;        // range start in the library view
+    dmem_mapping_size_t off;
+    dmem_mapping_size_t size;
+    const struct dmem_sim_ops_s *ops;
+    void *ctx;
+    unsigned flags;
+};
+
+int dmem__sim_nranges = 0;
+static struct sim_range_s sim_ranges[DMEM_SIM_MAX_RANGES];
+static unsigned sim_pagesize;
+
+static struct sim_range_s *sim_find(const char *p)
+{
+    int i;
+    for (i = 0; i < dmem__sim_nranges; i++) {
+        struct sim_range_s *r = &sim_ranges[i];
+        if (p >= r->user && p < r->user + r->size)
+            return r;
+    }
+    return NULL;
+}
+
+// Does [p, p + size) overlap an active range?
+static int sim_overlaps(const char *p, dmem_mapping_size_t size)
+{
+    int i;
+    for (i = 0; i < dmem__sim_nranges; i++) {
+        const struct sim_range_s *r = &sim_ranges[i];
+        if (p < r->user + r->size && r->user < p + size)
+            return 1;
+    }
+    return 0;
+}
+
+static uint32_t sim_do_read(struct sim_range_s *r, dmem_mapping_size_t roff)
+{
+    uint32_t *w = &r->alias[roff / sizeof(uint32_t)];
+    uint32_t v = *(volatile uint32_t *)w;
+    if (r->ops->read) {
+        v = r->ops->read(r->ctx, r->off + roff, v);
+        *(volatile uint32_t *)w = v;
+    }
+    return v;
+}
+
+static void sim_do_write(struct sim_range_s *r, dmem_mapping_size_t roff, uint32_t v, uint32_t old)
+{
+    uint32_t *w = &r->alias[roff / sizeof(uint32_t)];
+    if (r->ops->write)
+        v = r->ops->write(r->ctx, r->off + roff, v, old);
+    *(volatile uint32_t *)w = v;
+}
+
+//============================================================================
+// Direct-call hooks (LIBDEVMEM_SIM_HOOKS)
+//============================================================================
+
+int dmem__sim_read(void *mp, unsigned width, uint32_t *v)
+{
+    struct sim_range_s *r = sim_find((const char *)mp);
+    dmem_mapping_size_t roff;
+    unsigned sh;
+
+    if (!r)
+        return 0;
+    roff = (dmem_mapping_size_t)((const char *)mp - r->user);
+    sh = (roff & 3) * 8;
+    *v = sim_do_read(r, roff & ~3u) >> sh;
+    if (width < sizeof(uint32_t))
+        *v &= (1u << (width * 8)) - 1;
+    return 1;
+}
+
+int dmem__sim_write(void *mp, unsigned width, uint32_t v)
+{
+    struct sim_range_s *r = sim_find((const char *)mp);
+    dmem_mapping_size_t roff;
+    uint32_t old, nv, mask;
+    unsigned sh;
+
+    if (!r)
+        return 0;
+    roff = (dmem_mapping_size_t)((const char *)mp - r->user);
+    sh = (roff & 3) * 8;
+    roff &= ~3u;
+    old = *(volatile uint32_t *)&r->alias[roff / sizeof(uint32_t)];
+    mask = width < sizeof(uint32_t) ? ((1u << (width * 8)) - 1) << sh : 0xFFFFFFFFu;
+    nv = (old & ~mask) | ((v << sh) & mask);
+    sim_do_write(r, roff, nv, old);
+    return 1;
+}
+
+//============================================================================
+// Trap mode
+//============================================================================
+
+#if SIM_HAVE_TRAP
+
+// Access being single-stepped
+struct sim_step_s {
+    char *page;
+    char *addr;
+    unsigned width;         // bytes
+    int is_write;
+    uint32_t old[SIM_WRITE_WINDOW / sizeof(uint32_t)];
+};
+
+static __thread struct sim_step_s sim_step;
+static __thread int sim_stepping;
+static int sim_lock;    // one step at a time; does not make multi-thread access safe
+static int sim_handlers;
+static struct sigaction sim_old_segv, sim_old_trap;
+
+// Is p in a page protected by us?
+static int sim_trapped_page(const char *p)
+{
+    int i;
+    for (i = 0; i < dmem__sim_nranges; i++) {
+        struct sim_range_s *r = &sim_ranges[i];
+        const char *pg0, *pg1;
+        if (!(r->flags & SIM_TRAP))
+            continue;
+        pg0 = (const char *)((uintptr_t)r->user & ~(uintptr_t)(sim_pagesize - 1));
+        pg1 = (const char *)(((uintptr_t)r->user + r->size + sim_pagesize - 1) & ~(uintptr_t)(sim_pagesize - 1));
+        if (p >= pg0 && p < pg1)
+            return 1;
+    }
+    return 0;
+}
+
+// Memory operand width of the instruction at ip, for the load/store and
+// ALU forms compilers emit for register and buffer accesses; 0 = unknown
+static unsigned sim_insn_width(const uint8_t *ip)
+{
+    unsigned op16 = 0, rep = 0, rexw = 0, pp, l;
+
+    for ( ; ; ip++) { // legacy prefixes
+        if (*ip == 0x66)
+            op16 = 1;
+        else if (*ip == 0xF2 || *ip == 0xF3)
+            rep = *ip;
+        else if (*ip != 0xF0 && *ip != 0x67 && *ip != 0x2E && *ip != 0x3E &&
+                 *ip != 0x26 && *ip != 0x36 && *ip != 0x64 && *ip != 0x65)
+            break;
+    }
+    if ((*ip & 0xF0) == 0x40) // REX
+        rexw = (*ip++ >> 3) & 1;
+
+    if (ip[0] == 0xC5 || ip[0] == 0xC4) { // VEX, map 0F only
+        if (ip[0] == 0xC5) {
+            pp = ip[1] & 3;
+            l = (ip[1] >> 2) & 1;
+            ip += 2;
+        } else {
+            if ((ip[1] & 0x1F) != 1)
+                return 0;
+            rexw = ip[2] >> 7;
+            pp = ip[2] & 3;
+            l = (ip[2] >> 2) & 1;
+            ip += 3;
+        }
+        switch (ip[0]) {
+        case 0x10: case 0x11: // vmovups/upd/ss/sd
+            return pp == 2 ? 4 : pp == 3 ? 8 : 16u << l;
+        case 0x28: case 0x29: case 0x2B: case 0x6F: case 0x7F: case 0xE7:
+            return 16u << l;
+        case 0x6E: case 0x7E:
+            return (pp == 2 || rexw) ? 8 : 4;
+        case 0xD6:
+            return 8;
+        }
+        return 0;
+    }
+
+    if (ip[0] < 0x40 && (ip[0] & 7) < 4) // ALU r/m forms: add, or, and, sub, xor, cmp...
+        return (ip[0] & 1) ? (rexw ? 8 : op16 ? 2 : 4) : 1;
+    switch (ip[0]) {
+    case 0x80: case 0x84: case 0x86: case 0x88: case 0x8A: case 0xC6: case 0xF6: case 0xFE:
+        return 1;
+    case 0x81: case 0x83: case 0x85: case 0x87: case 0x89: case 0x8B: case 0xC7: case 0xF7: case 0xFF:
+        return rexw ? 8 : op16 ? 2 : 4;
+    case 0x0F:
+        switch (ip[1]) {
+        case 0xB6: case 0xBE: // movzx/movsx
+            return 1;
+        case 0xB7: case 0xBF:
+            return 2;
+        case 0x10: case 0x11: // movups/upd/ss/sd
+            return rep == 0xF3 ? 4 : rep == 0xF2 ? 8 : 16;
+        case 0x28: case 0x29: case 0x2B: case 0xE7:
+            return 16;
+        case 0x6F: case 0x7F: // movdqa/movdqu, or MMX movq
+            return (op16 || rep == 0xF3) ? 16 : 8;
+        case 0x6E:
+            return rexw ? 8 : 4;
+        case 0x7E:
+            return (rep == 0xF3 || rexw) ? 8 : 4;
+        case 0xD6:
+            return 8;
+        case 0xC3: // movnti
+            return rexw ? 8 : 4;
+        }
+    }
+    return 0;
+}
+
+static void sim_chain(const struct sigaction *old, int sig, siginfo_t *si, void *uc)
+{
+    if ((old->sa_flags & SA_SIGINFO) && old->sa_sigaction) {
+        old->sa_sigaction(sig, si, uc);
+    } else if (old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN) {
+        old->sa_handler(sig);
+    } else {
+        // SIG_DFL, or SIG_IGN which the kernel does not honor for faults:
+        // unhook and take the default action when the handler returns
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = SIG_DFL;
+        sigaction(sig, &sa, NULL);
+        sigaction(sig == SIGSEGV ? SIGTRAP : SIGSEGV,
+                  sig == SIGSEGV ? &sim_old_trap : &sim_old_segv, NULL);
+        sim_handlers = 0;
+        raise(sig);
+    }
+}
+
+static void sim_segv(int sig, siginfo_t *si, void *ucv)
+{
+    ucontext_t *uc = (ucontext_t *)ucv;
+    char *a = (char *)si->si_addr, *p;
+    struct sim_range_s *r;
+    unsigned i;
+
+    if (sim_stepping || !sim_trapped_page(a)) {
+        sim_chain(&sim_old_segv, sig, si, ucv);
+        return;
+    }
+    while (__atomic_test_and_set(&sim_lock, __ATOMIC_ACQUIRE))
+        ; // another thread is stepping on a trapped page
+
+    sim_step.page = (char *)((uintptr_t)a & ~(uintptr_t)(sim_pagesize - 1));
+    sim_step.addr = a;
+    sim_step.is_write = !!(uc->uc_mcontext.gregs[REG_ERR] & SIM_PF_WRITE);
+    sim_step.width = sim_insn_width((const uint8_t *)uc->uc_mcontext.gregs[REG_RIP]);
+    if (sim_step.width == 0)
+        sim_step.width = SIM_DEF_WIDTH;
+
+    if (!sim_step.is_write) {
+        // Every register the load touches
+        for (p = (char *)((uintptr_t)a & ~(uintptr_t)3); p < a + sim_step.width; p += sizeof(uint32_t)) {
+            r = sim_find(p);
+            if (r)
+                sim_do_read(r, (dmem_mapping_size_t)(p - r->user));
+        }
+    } else {
+        for (i = 0; i < SIM_WRITE_WINDOW / sizeof(uint32_t); i++) {
+            p = (char *)((uintptr_t)a & ~(uintptr_t)3) + i * sizeof(uint32_t);
+            r = sim_find(p);
+            if (r)
+                sim_step.old[i] = r->alias[(p - r->user) / sizeof(uint32_t)];
+        }
+    }
+
+    sim_stepping = 1;
+    mprotect(sim_step.page, sim_pagesize, PROT_READ | PROT_WRITE);
+    uc->uc_mcontext.gregs[REG_EFL] |= SIM_EFL_TF;
+}
+
+static void sim_trap(int sig, siginfo_t *si, void *ucv)
+{
+    ucontext_t *uc = (ucontext_t *)ucv;
+    unsigned i;
+
+    if (!sim_stepping) {
+        sim_chain(&sim_old_trap, sig, si, ucv);
+        return;
+    }
+    uc->uc_mcontext.gregs[REG_EFL] &= ~SIM_EFL_TF;
+
+    if (sim_step.is_write) {
+        for (i = 0; i < SIM_WRITE_WINDOW / sizeof(uint32_t); i++) {
+            char *p = (char *)((uintptr_t)sim_step.addr & ~(uintptr_t)3) + i * sizeof(uint32_t);
+            struct sim_range_s *rw = sim_find(p);
+            dmem_mapping_size_t roff;
+            uint32_t v;
+            if (!rw)
+                continue;
+            roff = (dmem_mapping_size_t)(p - rw->user);
+            v = rw->alias[roff / sizeof(uint32_t)];
+            // Words in the decoded access are written, others only if changed
+            // (an instruction not decoded may be wider than SIM_DEF_WIDTH)
+            if (p < sim_step.addr + sim_step.width || v != sim_step.old[i])
+                sim_do_write(rw, roff, v, sim_step.old[i]);
+        }
+    }
+
+    mprotect(sim_step.page, sim_pagesize, PROT_NONE);
+    sim_stepping = 0;
+    __atomic_clear(&sim_lock, __ATOMIC_RELEASE);
+}
+
+static int sim_install_handlers(void)
+{
+    struct sigaction sa;
+
+    if (sim_handlers)
+        return 0;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_sigaction = sim_segv;
+    if (sigaction(SIGSEGV, &sa, &sim_old_segv) != 0)
+        return errno;
+    sa.sa_sigaction = sim_trap;
+    if (sigaction(SIGTRAP, &sa, &sim_old_trap) != 0) {
+        int err = errno;
+        sigaction(SIGSEGV, &sim_old_segv, NULL);
+        return err;
+    }
+    sim_handlers = 1;
+    return 0;
+}
+
+static void sim_remove_handlers(void)
+{
+    if (!sim_handlers)
+        return;
+    sigaction(SIGSEGV, &sim_old_segv, NULL);
+    sigaction(SIGTRAP, &sim_old_trap, NULL);
+    sim_handlers = 0;
+}
+#endif // SIM_HAVE_TRAP
+
+// Set protection of the pages of range r in the user view
+static int sim_protect(struct sim_range_s *r, int prot)
+{
+    uintptr_t pg0 = (uintptr_t)r->user & ~(uintptr_t)(sim_pagesize - 1);
+    uintptr_t pg1 = ((uintptr_t)r->user + r->size + sim_pagesize - 1) & ~(uintptr_t)(sim_pagesize - 1);
+    if (mprotect((void *)pg0, pg1 - pg0, prot) != 0)
+        return errno;
+    return 0;
+}
+
+int dmem_sim_add_active(dmem_mapping_hnd_t dp, dmem_mapping_size_t off, dmem_mapping_size_t size,
+                        const struct dmem_sim_ops_s *ops, void *ctx, unsigned flags)
+{
+    struct sim_range_s *r;
+    char *alias;
+
+    if (!dp || !ops)
+        return -1;
+    if (!(dp->flags & MF_SIMULATED))
+        return EINVAL;
+    if (!(flags & SIM_TRAP) && !dmem__sim_hooks_built)
+        return ENOTSUP; // callbacks would never be called
+    if (((off | size) & 3) || size == 0)
+        return EINVAL;
+    if (!dmem_get_pointer(dp, off, size))
+        return ERANGE;
+    alias = dmem__sim_alias(dp);
+    if (!alias)
+        return EINVAL;
+    if (dmem__sim_nranges >= DMEM_SIM_MAX_RANGES)
+        return ENOMEM;
+    if (sim_overlaps(dp->map_ptr + off, size))
+        return EEXIST;
+#if !SIM_HAVE_TRAP
+    if (flags & SIM_TRAP)
+        return ENOTSUP;
+#endif
+    if ((flags & SIM_TRAP) && (dp->flags & MF_READONLY))
+        return EINVAL; // would need to restore PROT_READ after each step
+    if (!sim_pagesize)
+        sim_pagesize = (unsigned)getpagesize();
+
+    r = &sim_ranges[dmem__sim_nranges];
+    r->dp = dp;
+    r->user = dp->map_ptr + off;
+    r->alias = (uint32_t *)(alias + off);
+    r->off = off;
+    r->size = size;
+    r->ops = ops;
+    r->ctx = ctx;
+    r->flags = flags;
+
+#if SIM_HAVE_TRAP
+    if (flags & SIM_TRAP) {
+        int err = sim_install_handlers();
+        if (!err)
+            err = sim_protect(r, PROT_NONE);
+        if (err)
+            return err;
+    }
+#endif
+    // Publish after setup, the hooks may be called from other threads
+    __atomic_store_n(&dmem__sim_nranges, dmem__sim_nranges + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void dmem_sim_clear(dmem_mapping_hnd_t dp)
+{
+    int i, n = 0, traps = 0;
+
+    for (i = 0; i < dmem__sim_nranges; i++) {
+        struct sim_range_s *r = &sim_ranges[i];
+        if (r->dp == dp) {
+            if (r->flags & SIM_TRAP)
+                sim_protect(r, PROT_READ | PROT_WRITE);
+            continue;
+        }
+        traps |= !!(r->flags & SIM_TRAP);
+        sim_ranges[n++] = *r;
+    }
+    __atomic_store_n(&dmem__sim_nranges, n, __ATOMIC_RELEASE);
+#if SIM_HAVE_TRAP
+    if (!traps)
+        sim_remove_handlers();
+#else
+    (void)traps;
+#endif
+}
@@ -0,0 +1,85 @@
+/**
+* libdevmem extras: simulated device
+*
+* A mapping with MF_SIMULATED (or any mapping when DEVMEMOPT contains
+* "+sim") is backed by a memfd instead of /dev/mem, so it behaves as RAM.
+* Register ranges declared "active" call user callbacks on access:
+*
+*  - SIM_TRAP: the pages are protected; an access faults (SIGSEGV), the
+*    read callbacks are called, the instruction is single-stepped on the
+*    backing memory, and then the write callbacks are called, once per
+*    register in the access. The access width is decoded for the usual
+*    mov/movzx/ALU and SSE/AVX load/store forms, including the 128-bit
+*    accesses of the library kernels; other instructions (e.g. rep movs)
+*    are taken as 4-byte accesses, and of their other written words only
+*    those whose value changed reach the write callback.
+*    x86-64 only. Callbacks run in the signal handler: don't use malloc,
+*    stdio etc. Access the trapped pages from one thread only: while an
+*    access is stepped the page is unprotected, and accesses from other
+*    threads in that window bypass the callbacks. An access crossing into
+*    a second protected page is not supported.
+*
+*  - Direct-call hooks: build libdevmem.c with -DLIBDEVMEM_SIM_HOOKS and
+*    the dmem_read/write/fill... functions call the callbacks directly,
+*    with no faults. Without it, ranges without SIM_TRAP are refused.
+*    Accesses through pointers bypass the hooks and are only seen with
+*    SIM_TRAP: dmem_get_pointer() users, dmem_mtest_run(), the scrub
+*    thread, dmem_csum_region/verify(), dmem_read/write_buf32_csum() and
+*    the register sampler.
+*
+* Registers are 32-bit; 8 and 16-bit accesses read or modify the 32-bit
+* word that contains them.
+*/
+
+#ifndef libdevmem_sim_h_
+#define libdevmem_sim_h_
+
+#include "libdevmem.h"
+
+#define DMEM_SIM_MAX_RANGES 64
+
+struct dmem_sim_ops_s {
+    // Register read: return the value the reader gets. Can be NULL (read as memory).
+    // @param stored - current value in the backing memory
+    uint32_t (*read)(void *ctx, dmem_mapping_size_t off, uint32_t stored);
+    // Register write: return the value to keep in the backing memory. Can be NULL (keep v).
+    // @param v   - written value
+    // @param old - value in the backing memory before the write
+    uint32_t (*write)(void *ctx, dmem_mapping_size_t off, uint32_t v, uint32_t old);
+};
+
+enum dmem_sim_flags {
+    SIM_TRAP = 0x01, // trap raw pointer accesses via page protection
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Declare an active register range in a simulated mapping
+// @param[in] dp    - mapping, after successfull dmem_mapping_map() with MF_SIMULATED
+// @param[in] off, size - range, 4-byte aligned; offsets passed to callbacks are from the mapping base
+// @param[in] ops   - callbacks, must stay valid until the mapping is unmapped
+// @param[in] ctx   - user context for callbacks
+// @param[in] flags - dmem_sim_flags
+// @return error code; ENOTSUP for SIM_TRAP on other than x86-64, or
+//         without SIM_TRAP when libdevmem.c is built without LIBDEVMEM_SIM_HOOKS,
+//         EEXIST if the range overlaps an active range
+int dmem_sim_add_active(dmem_mapping_hnd_t dp, dmem_mapping_size_t off, dmem_mapping_size_t size,
+                        const struct dmem_sim_ops_s *ops, void *ctx, unsigned flags);
+
+// Remove all active ranges of the mapping. Called by dmem_mapping_unmap().
+void dmem_sim_clear(dmem_mapping_hnd_t dp);
+
+// Library internal: direct-call hooks used by libdevmem.c with LIBDEVMEM_SIM_HOOKS
+extern int dmem__sim_nranges;
+extern const int dmem__sim_hooks_built;
+int dmem__sim_read(void *mp, unsigned width, uint32_t *v);
+int dmem__sim_write(void *mp, unsigned width, uint32_t v);
+void *dmem__sim_alias(dmem_mapping_hnd_t dp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* libdevmem_sim_h_ */
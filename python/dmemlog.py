@@ -0,0 +1,123 @@
+"""
+Reader for libdevmem sampler logs (see libdevmem_sampler.h)
+
+Can read a log while the sampler is still writing it.
+
+Usage:
+    import dmemlog
+    L = dmemlog.Cslog("/tmp/counters.slog")
+    for t, values in L.records():
+        print(t, values)
+"""
+
+from __future__ import print_function
+import struct
+from mmap import *
+
+SLOG_MAGIC   = 0x474F4C53
+SLOG_VERSION = 1
+SLOG_MAX_PROBES = 256
+
+_HDR   = struct.Struct('<IIIIIIQQQqQQ')
+_PROBE = struct.Struct('<IIII')
+
+class Cslog:
+    """ Represents a sampler log file """
+
+    def __init__(self, path):
+        self.f = open(path, 'rb')
+        self.mm = None
+        try:
+            self.mm = mmap(self.f.fileno(), 0, MAP_SHARED, PROT_READ)
+        except ValueError:  # empty file
+            pass
+        if self.mm is None or len(self.mm) < _HDR.size :
+            self.close()
+            raise ValueError("Not a sampler log: %s" % path)
+        (magic, version, self.hdr_size, self.rec_size, self.nprobes, self.rate_hz,
+         self.capacity, self.ts_hz, _, _, _, _) = _HDR.unpack_from(self.mm, 0)
+        if magic != SLOG_MAGIC or version != SLOG_VERSION :
+            self.close()
+            raise ValueError("Not a sampler log: %s" % path)
+        if not self._valid() :
+            self.close()
+            raise ValueError("Corrupt or truncated sampler log: %s" % path)
+        self.probes = []   # list of (offset, width, phys_addr)
+        for i in range(self.nprobes):
+            off, width, pha, _ = _PROBE.unpack_from(self.mm, _HDR.size + i * _PROBE.size)
+            self.probes.append( (off, width, pha) )
+        self._rec = struct.Struct('<Q%dI' % self.nprobes)
+
+    def _valid(self):
+        """ Header sizes agree with nprobes and the file, as dmem_slog_open() checks """
+        size = len(self.mm)
+        if not (0 < self.nprobes <= SLOG_MAX_PROBES) or self.capacity == 0 or self.ts_hz == 0 :
+            return False
+        if (self.hdr_size < _HDR.size + self.nprobes * _PROBE.size or
+            self.rec_size < 8 + 4 * self.nprobes or
+            (self.hdr_size | self.rec_size) & 7 or self.hdr_size > size) :
+            return False
+        return self.capacity <= (size - self.hdr_size) // self.rec_size
+
+    def close(self):
+        if self.mm is not None :
+            self.mm.close()
+            self.mm = None
+        if self.f is not None :
+            self.f.close()
+            self.f = None
+
+    def _header(self):
+        """ Header fields that change while sampling """
+        h = _HDR.unpack_from(self.mm, 0)
+        return { 'ts0': h[8], 'realtime0_ns': h[9], 'n_records': h[10], 'missed': h[11] }
+
+    def missed(self): return self._header()['missed']
+
+    def realtime0(self):
+        """ Wall clock time of the log start, seconds since the epoch """
+        return self._header()['realtime0_ns'] / 1e9
+
+    def _ts(self, i):
+        return struct.unpack_from('<Q', self.mm, self.hdr_size + i * self.rec_size)[0]
+
+    def count(self):
+        """ Number of valid records now """
+        lo = self._header()['n_records']
+        if lo > self.capacity or (lo and self._ts(lo - 1) == 0) :
+            lo = 0
+        hi = self.capacity
+        while lo < hi :
+            mid = (lo + hi) // 2
+            if self._ts(mid) : lo = mid + 1
+            else : hi = mid
+        return lo
+
+    def record(self, i):
+        """ Record i as (seconds from start, tuple of values), None if not written """
+        if not (0 <= i < self.capacity) :
+            return None
+        r = self._rec.unpack_from(self.mm, self.hdr_size + i * self.rec_size)
+        if r[0] == 0 :
+            return None
+        ts0 = self._header()['ts0']
+        return ( (r[0] - ts0) / float(self.ts_hz), r[1:] )
+
+    def records(self, start=0):
+        """ Iterate over the records written so far """
+        ts0 = self._header()['ts0']
+        for i in range(start, self.count()):
+            r = self._rec.unpack_from(self.mm, self.hdr_size + i * self.rec_size)
+            yield ( (r[0] - ts0) / float(self.ts_hz), r[1:] )
+
+    def __repr__(self):
+        return("Sampler log: %d probes @%d Hz, %d of %d records" %
+               (self.nprobes, self.rate_hz, self.count(), self.capacity))
+
+
+if __name__ == "__main__":
+    import sys
+    L = Cslog(sys.argv[1])
+    print(L)
+    for t, v in L.records():
+        print("%.6f " % t + " ".join(["%8.8X" % x for x in v]))
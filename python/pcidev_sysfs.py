@@ -57,6 +57,35 @@ def getPCIdeviceBarPath(path, barNum) :
     return path + '/resource' + str(barNum)
 
 
+def getPCIdeviceNumaNode(path) :
+   """ From sysfs path, get NUMA node of the device.
+       Returns -1 if unknown or not a NUMA system
+   """
+   try:
+     with open(path + "/numa_node") as f:
+       return int(f.read(),0)
+   except (IOError, ValueError):
+     return -1
+
+
+def getPCIdeviceLocalCpus(path) :
+   """ From sysfs path, get CPUs local to the device (local_cpulist).
+       Returns set of CPU numbers
+   """
+   cpus = set()
+   with open(path + "/local_cpulist") as f:
+     for r in f.read().strip().split(','):
+       if not r : continue
+       a = r.split('-')
+       cpus.update(range(int(a[0]), int(a[-1])+1))
+   return cpus
+
+
+def pinToDeviceCpus(path) :
+   """ Pin the calling thread to CPUs local to the device. Python 3.3+ """
+   os.sched_setaffinity(0, getPCIdeviceLocalCpus(path))
+
+
 # Open a PCI BAR resource or config space as file, return a python file object
 # Caller can then mmap it.
 def openDeviceBar(path, bar=0, access='r') :
@@ -87,6 +116,7 @@ def _test():
   print("It has %d BAR%s" % (len(bars), '' if len(bars) == 1 else 's')   )
   for p in bars:
     print("Phys addr %#X size %#X" % (p[0],p[1]))
+  print("NUMA node %d" % getPCIdeviceNumaNode(s))
   #
   barfile, bar_size = openDeviceBar(s,0,'rw')
   print("BAR0 size=%X" % bar_size)
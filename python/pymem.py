@@ -28,6 +28,7 @@ class Cmmdev:
         self.ptr4 = None
         self.ptr2 = None
         self.ptr1 = None
+        self.numa_node = mypci.getPCIdeviceNumaNode(sysfsPath)
 
         bars = mypci.getPCIdeviceBars(sysfsPath)
         self.mm_base,barsize = bars[barNum]
@@ -100,6 +101,8 @@ class Cmmdev:
 
     def getSize(self): return self.mm_winsize
 
+    def getNumaNode(self): return self.numa_node
+
     def printx(self, offs, cnt=1):
         """ Print cnt words from given offset, in hex """
         for i in range (cnt):